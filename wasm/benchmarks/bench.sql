@@ -0,0 +1,232 @@
+-- Benchmark suite of the wasm executor, run it through run.sh.
+--
+-- Variables: bench_dir (directory of this file), tmp_dir, rows, iterations
+-- and label.
+-- Every benchmark runs the same query through the wasm, PL/pgSQL and native C
+-- variants, and bench.measure() records min/median/mean over the iterations.
+
+\set ON_ERROR_STOP on
+
+DROP SCHEMA IF EXISTS bench CASCADE;
+CREATE SCHEMA bench;
+
+CREATE TABLE bench.config(
+    bench_dir     text,
+    tmp_dir       text,
+    rows          bigint,
+    iterations    integer,
+    label         text,
+    instanceid    bigint,
+    has_native    boolean
+);
+INSERT INTO bench.config VALUES (:'bench_dir', :'tmp_dir', :rows, :iterations, :'label', NULL, false);
+
+CREATE TABLE bench.results(
+    benchmark     text,
+    variant       text,
+    rows          bigint,
+    iterations    integer,
+    min_ms        float8,
+    median_ms     float8,
+    mean_ms       float8,
+    ns_per_row    float8
+);
+
+-- Run query once to warm up, then iterations times, and record the timings.
+CREATE FUNCTION bench.measure(benchmark text, variant text, nrows bigint, query text, iterations integer)
+RETURNS void AS $$
+DECLARE
+    started timestamptz;
+    timings float8[] := '{}';
+BEGIN
+    EXECUTE query;
+    FOR i IN 1..iterations LOOP
+        started := clock_timestamp();
+        EXECUTE query;
+        timings := timings || (extract(epoch FROM clock_timestamp() - started) * 1000)::float8;
+    END LOOP;
+
+    INSERT INTO bench.results
+    SELECT benchmark, variant, nrows, iterations, min(t),
+        (SELECT m FROM unnest(timings) m ORDER BY m OFFSET iterations / 2 LIMIT 1),
+        avg(t), (SELECT m FROM unnest(timings) m ORDER BY m OFFSET iterations / 2 LIMIT 1) * 1000000 / nrows
+    FROM unnest(timings) t;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Setup: module, functions and data
+
+CREATE EXTENSION IF NOT EXISTS wasm_executor;
+
+UPDATE bench.config SET instanceid = wasm_create_new_instance_wat(bench_dir || '/bench.wat');
+
+DO $$
+DECLARE
+    module text := (SELECT bench_dir || '/bench.wat' FROM bench.config);
+BEGIN
+    EXECUTE format('CREATE FUNCTION bench.noop_wasm() RETURNS integer AS %L LANGUAGE wasm', module || ':noop');
+    EXECUTE format('CREATE FUNCTION bench.add_i32_wasm(integer, integer) RETURNS integer AS %L LANGUAGE wasm STRICT',
+        module || ':add_i32');
+    EXECUTE format('CREATE FUNCTION bench.add_i64_wasm(bigint, bigint) RETURNS bigint AS %L LANGUAGE wasm STRICT',
+        module || ':add_i64');
+    EXECUTE format('CREATE FUNCTION bench.echo_wasm(bytea) RETURNS bytea AS %L LANGUAGE wasm STRICT',
+        module || ':echo');
+    EXECUTE format('CREATE FUNCTION bench.add_batch_wasm(bigint[], bigint[]) RETURNS bigint[] AS %L LANGUAGE wasm STRICT',
+        module || ':add_batch');
+END;
+$$;
+
+CREATE FUNCTION bench.noop_plpgsql() RETURNS integer AS $$
+BEGIN
+    RETURN 0;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE FUNCTION bench.add_i32_plpgsql(a integer, b integer) RETURNS integer AS $$
+BEGIN
+    RETURN a + b;
+END;
+$$ LANGUAGE plpgsql STRICT;
+
+CREATE FUNCTION bench.add_i64_plpgsql(a bigint, b bigint) RETURNS bigint AS $$
+BEGIN
+    RETURN a + b;
+END;
+$$ LANGUAGE plpgsql STRICT;
+
+CREATE FUNCTION bench.echo_plpgsql(data bytea) RETURNS bytea AS $$
+BEGIN
+    RETURN data;
+END;
+$$ LANGUAGE plpgsql STRICT;
+
+-- The native variants need native/bench_native to be installed, they are
+-- skipped otherwise.
+DO $$
+BEGIN
+    CREATE FUNCTION bench.noop_c() RETURNS integer AS '$libdir/bench_native', 'bench_noop_c' LANGUAGE C;
+    CREATE FUNCTION bench.add_i32_c(integer, integer) RETURNS integer
+        AS '$libdir/bench_native', 'bench_add_i32_c' LANGUAGE C STRICT;
+    CREATE FUNCTION bench.add_i64_c(bigint, bigint) RETURNS bigint
+        AS '$libdir/bench_native', 'bench_add_i64_c' LANGUAGE C STRICT;
+    CREATE FUNCTION bench.echo_c(bytea) RETURNS bytea AS '$libdir/bench_native', 'bench_echo_c' LANGUAGE C STRICT;
+    UPDATE bench.config SET has_native = true;
+EXCEPTION WHEN OTHERS THEN
+    RAISE NOTICE 'bench_native is not installed, skipping the native C variants';
+END;
+$$;
+
+CREATE TABLE bench.numbers AS
+SELECT g::bigint AS a, (g * 7)::bigint AS b FROM generate_series(1, (SELECT rows FROM bench.config)) g;
+
+CREATE TABLE bench.payloads AS
+SELECT size, count, decode(repeat('78', size), 'hex') AS data
+FROM (VALUES (1024, 1000), (65536, 100), (1048576, 10)) v(size, count), generate_series(1, count);
+
+ANALYZE bench.numbers;
+ANALYZE bench.payloads;
+
+-- Benchmarks
+
+DO $$
+DECLARE
+    nrows bigint := (SELECT rows FROM bench.config);
+    iterations integer := (SELECT iterations FROM bench.config);
+    variants text[] := CASE WHEN (SELECT has_native FROM bench.config)
+        THEN ARRAY['wasm', 'plpgsql', 'c'] ELSE ARRAY['wasm', 'plpgsql'] END;
+    variant text;
+    payload record;
+BEGIN
+    FOREACH variant IN ARRAY variants LOOP
+        -- Pure call overhead
+        PERFORM bench.measure('noop', variant, nrows,
+            format('SELECT sum(bench.noop_%s()) FROM generate_series(1, %s)', variant, nrows), iterations);
+        PERFORM bench.measure('add_i32', variant, nrows,
+            format('SELECT sum(bench.add_i32_%s(a::integer, 1)) FROM bench.numbers', variant), iterations);
+        PERFORM bench.measure('add_i64', variant, nrows,
+            format('SELECT sum(bench.add_i64_%s(a, b)) FROM bench.numbers', variant), iterations);
+
+        -- Varlena round trips through linear memory
+        FOR payload IN SELECT DISTINCT size, count FROM bench.payloads ORDER BY size LOOP
+            PERFORM bench.measure('echo_' || payload.size, variant, payload.count,
+                format('SELECT sum(length(bench.echo_%s(data))) FROM bench.payloads WHERE size = %s',
+                    variant, payload.size), iterations);
+        END LOOP;
+    END LOOP;
+
+    -- Batched against per-row invocation over the same table
+    PERFORM bench.measure('add_i64_table', 'wasm_per_row', nrows,
+        'SELECT sum(bench.add_i64_wasm(a, b)) FROM bench.numbers', iterations);
+    PERFORM bench.measure('add_i64_table', 'wasm_batch', nrows,
+        'SELECT sum(x) FROM unnest((SELECT bench.add_batch_wasm(array_agg(a), array_agg(b)) FROM bench.numbers)) x',
+        iterations);
+    PERFORM bench.measure('add_i64_table', 'wasm_invoke_batch', nrows,
+        format('SELECT sum(x) FROM unnest((SELECT wasm_invoke_batch(%L, %L, array_agg(a), array_agg(b)) FROM bench.numbers)) x',
+            (SELECT instanceid FROM bench.config)::text, 'add_batch'), iterations);
+    PERFORM bench.measure('add_i64_table', 'sql', nrows, 'SELECT sum(a + b) FROM bench.numbers', iterations);
+END;
+$$;
+
+-- Compile: generated modules of 200 functions. Every cold iteration loads a
+-- module with a nonce of its own, so that it misses the compiled module cache;
+-- all of them are written before the timing starts. The cached case loads the
+-- same bytes again. run.sh removes the cache entries they leave behind.
+CREATE FUNCTION bench.write_module(path text, nonce integer) RETURNS void AS $$
+BEGIN
+    EXECUTE format('COPY (SELECT %L) TO %L',
+        '(module (global (export "nonce") i32 (i32.const ' || nonce || '))' ||
+        (SELECT string_agg(format('(func (export "f%s") (param i64) (result i64) local.get 0 i64.const %s i64.mul '
+            'i64.const %s i64.add local.get 0 i64.xor)', g, g, g * 3), ' ') FROM generate_series(1, 200) g) || ')',
+        path);
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE FUNCTION bench.load_module(path text) RETURNS void AS $$
+BEGIN
+    PERFORM wasm_drop_instance(wasm_create_new_instance_wat(path));
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE SEQUENCE bench.cold_module MINVALUE 0 START 0;
+
+DO $$
+DECLARE
+    path text := (SELECT tmp_dir || '/wasm_bench_compile' FROM bench.config);
+    iterations integer := (SELECT iterations FROM bench.config);
+BEGIN
+    PERFORM bench.write_module(path || '.wat', 0);
+    -- One more than iterations for the warm-up run of bench.measure
+    FOR i IN 0..iterations LOOP
+        PERFORM bench.write_module(path || '_' || i || '.wat', (random() * 2147483647)::integer);
+    END LOOP;
+    PERFORM bench.measure('compile', 'cached', 1, format('SELECT bench.load_module(%L)', path || '.wat'), iterations);
+    PERFORM bench.measure('compile', 'cold', 1,
+        format('SELECT bench.load_module(%L || ''_'' || nextval(''bench.cold_module'') || ''.wat'')', path),
+        iterations);
+END;
+$$;
+
+-- Instantiation: with wasm.instance_reset = statement every statement below
+-- gets a fresh instance, and wasm.stat_modules reports the time it took.
+CREATE TABLE bench.instantiate_before AS
+SELECT instantiations, instantiate_time FROM wasm.stat_modules WHERE instanceid = (SELECT instanceid FROM bench.config);
+
+SET wasm.instance_reset = 'statement';
+SELECT bench.noop_wasm();
+SELECT bench.noop_wasm();
+SELECT bench.noop_wasm();
+SELECT bench.noop_wasm();
+SELECT bench.noop_wasm();
+SELECT bench.noop_wasm();
+SELECT bench.noop_wasm();
+SELECT bench.noop_wasm();
+SELECT bench.noop_wasm();
+SELECT bench.noop_wasm();
+RESET wasm.instance_reset;
+
+INSERT INTO bench.results
+SELECT 'instantiate', 'wasm', 1, n, NULL, NULL, t / n, t / n * 1000000
+FROM (SELECT s.instantiations - b.instantiations AS n, s.instantiate_time - b.instantiate_time AS t
+      FROM wasm.stat_modules s, bench.instantiate_before b
+      WHERE s.instanceid = (SELECT instanceid FROM bench.config)) d
+WHERE n > 0;
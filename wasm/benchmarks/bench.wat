@@ -0,0 +1,110 @@
+;; Guest side of the benchmark suite, see run.sh.
+(module
+  (memory (export "memory") 1)
+  (global $heap (mut i32) (i32.const 65536))
+
+  ;; Bump allocator, memory is never returned
+  (func $alloc (export "alloc") (param $size i32) (result i32)
+    (local $ptr i32)
+    (local $end i32)
+    global.get $heap
+    i32.const 7
+    i32.add
+    i32.const -8
+    i32.and
+    local.tee $ptr
+    local.get $size
+    i32.add
+    local.tee $end
+    memory.size
+    i32.const 16
+    i32.shl
+    i32.gt_u
+    if
+      local.get $end
+      memory.size
+      i32.const 16
+      i32.shl
+      i32.sub
+      i32.const 65535
+      i32.add
+      i32.const 16
+      i32.shr_u
+      memory.grow
+      i32.const -1
+      i32.eq
+      if
+        i32.const 0
+        return
+      end
+    end
+    local.get $end
+    global.set $heap
+    local.get $ptr)
+
+  (func (export "noop") (result i32)
+    i32.const 0)
+
+  (func (export "add_i32") (param i32 i32) (result i32)
+    local.get 0
+    local.get 1
+    i32.add)
+
+  (func (export "add_i64") (param i64 i64) (result i64)
+    local.get 0
+    local.get 1
+    i64.add)
+
+  ;; bytea round trip: return the argument buffer as (ptr << 32 | len)
+  (func (export "echo") (param $ptr i32) (param $len i32) (result i64)
+    local.get $ptr
+    i64.extend_i32_u
+    i64.const 32
+    i64.shl
+    local.get $len
+    i64.extend_i32_u
+    i64.or)
+
+  ;; Batch of add_i64: out[i] = a[i] + b[i], with b following a in memory
+  (func (export "add_batch") (param $in i32) (param $nrows i32) (param $out i32)
+    (local $b i32)
+    (local $end i32)
+    local.get $in
+    local.get $nrows
+    i32.const 3
+    i32.shl
+    i32.add
+    local.tee $b
+    local.set $end
+    block
+      local.get $in
+      local.get $end
+      i32.ge_u
+      br_if 0
+      loop
+        local.get $out
+        local.get $in
+        i64.load
+        local.get $b
+        i64.load
+        i64.add
+        i64.store
+        local.get $in
+        i32.const 8
+        i32.add
+        local.set $in
+        local.get $b
+        i32.const 8
+        i32.add
+        local.set $b
+        local.get $out
+        i32.const 8
+        i32.add
+        local.set $out
+        local.get $in
+        local.get $end
+        i32.lt_u
+        br_if 0
+      end
+    end)
+)
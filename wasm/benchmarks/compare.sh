@@ -0,0 +1,29 @@
+#!/bin/bash
+#
+# Compare two result files of run.sh by ns_per_row (mean if there was no
+# median) and report benchmarks that got slower than threshold percent.
+#
+#   ./compare.sh baseline.csv results.csv [threshold%]
+
+if [ $# -lt 2 ]; then
+    sed -n '3,6p' "$0"
+    exit 1
+fi
+
+awk -F, -v threshold="${3:-10}" '
+    FNR == 1 { next }
+    NR == FNR { base[$2 "," $3] = $9; next }
+    {
+        key = $2 "," $3
+        if (!(key in base) || base[key] <= 0) {
+            next
+        }
+        change = ($9 - base[key]) * 100 / base[key]
+        status = (change > threshold) ? "REGRESSION" : "ok"
+        printf "%-40s %12.1f %12.1f %+8.1f%% %s\n", key, base[key], $9, change, status
+        if (change > threshold) {
+            failed = 1
+        }
+    }
+    END { exit failed }
+' "$1" "$2"
@@ -0,0 +1,48 @@
+/*
+ * Native C equivalents of the benchmark functions in bench.wat, the baseline
+ * the wasm and PL/pgSQL variants are compared against.
+ */
+#include "postgres.h"
+#include "knl/knl_variable.h"
+#include "fmgr.h"
+#include "utils/builtins.h"
+
+PG_MODULE_MAGIC;
+
+extern "C" Datum bench_noop_c(PG_FUNCTION_ARGS);
+extern "C" Datum bench_add_i32_c(PG_FUNCTION_ARGS);
+extern "C" Datum bench_add_i64_c(PG_FUNCTION_ARGS);
+extern "C" Datum bench_echo_c(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(bench_noop_c);
+Datum bench_noop_c(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT32(0);
+}
+
+PG_FUNCTION_INFO_V1(bench_add_i32_c);
+Datum bench_add_i32_c(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT32(PG_GETARG_INT32(0) + PG_GETARG_INT32(1));
+}
+
+PG_FUNCTION_INFO_V1(bench_add_i64_c);
+Datum bench_add_i64_c(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT64(PG_GETARG_INT64(0) + PG_GETARG_INT64(1));
+}
+
+// Copies its argument, like the wasm variant copies in and out of the guest
+PG_FUNCTION_INFO_V1(bench_echo_c);
+Datum bench_echo_c(PG_FUNCTION_ARGS)
+{
+    bytea *data = PG_GETARG_BYTEA_PP(0);
+    size_t len = VARSIZE_ANY_EXHDR(data);
+    bytea *result = (bytea*)palloc(len + VARHDRSZ);
+    SET_VARSIZE(result, len + VARHDRSZ);
+    if (len > 0) {
+        errno_t rc = memcpy_s(VARDATA(result), len, VARDATA_ANY(data), len);
+        securec_check_c(rc, "\0", "\0");
+    }
+    PG_RETURN_BYTEA_P(result);
+}
@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# Run the benchmark suite against a local openGauss with wasm_executor
+# installed, and write the results as CSV.
+#
+#   ./run.sh [-d dbname] [-p port] [-r rows] [-i iterations] [-l label]
+#            [-o results.csv] [-b baseline.csv] [-t threshold%]
+#
+# With -b, the results are compared with an earlier run by compare.sh, and
+# the script fails if a benchmark got slower than the threshold (10%).
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+DBNAME=postgres
+PORT=${PGPORT:-5432}
+ROWS=100000
+ITERATIONS=10
+LABEL=$(git -C "$BENCH_DIR" describe --always --dirty 2>/dev/null || echo unknown)
+OUTPUT=results.csv
+BASELINE=
+THRESHOLD=10
+TMP_DIR=${TMPDIR:-/tmp}
+
+while getopts "d:p:r:i:l:o:b:t:h" opt; do
+    case $opt in
+        d) DBNAME=$OPTARG ;;
+        p) PORT=$OPTARG ;;
+        r) ROWS=$OPTARG ;;
+        i) ITERATIONS=$OPTARG ;;
+        l) LABEL=$OPTARG ;;
+        o) OUTPUT=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        t) THRESHOLD=$OPTARG ;;
+        *) sed -n '3,11p' "$0"; exit 1 ;;
+    esac
+done
+
+if command -v gsql > /dev/null; then
+    CLIENT=gsql
+else
+    CLIENT=psql
+fi
+
+SQL="$CLIENT -X -q -d $DBNAME -p $PORT"
+
+# The compile benchmarks fill the compiled module cache with modules of their
+# own, the entries added by the run are removed once it is done
+CACHE_DIR="$($SQL -A -t -c "SHOW data_directory")/wasm_cache"
+CACHED_BEFORE=$(ls "$CACHE_DIR" 2> /dev/null || true)
+
+$SQL -v bench_dir="$BENCH_DIR" -v tmp_dir="$TMP_DIR" -v rows="$ROWS" -v iterations="$ITERATIONS" \
+    -v label="$LABEL" -f "$BENCH_DIR/bench.sql"
+
+for entry in $(ls "$CACHE_DIR" 2> /dev/null); do
+    if ! grep -qxF "$entry" <<< "$CACHED_BEFORE"; then
+        rm -f "$CACHE_DIR/$entry" || echo "could not remove $CACHE_DIR/$entry" >&2
+    fi
+done
+rm -f "$TMP_DIR"/wasm_bench_compile*.wat || true
+
+$SQL -A -F, -P footer=off -c "SELECT c.label, r.benchmark, r.variant, r.rows, r.iterations,
+        round(r.min_ms::numeric, 4) AS min_ms, round(r.median_ms::numeric, 4) AS median_ms,
+        round(r.mean_ms::numeric, 4) AS mean_ms, round(r.ns_per_row::numeric, 1) AS ns_per_row
+    FROM bench.results r, bench.config c ORDER BY r.benchmark, r.variant" > "$OUTPUT"
+
+echo "Results written to $OUTPUT"
+column -s, -t < "$OUTPUT"
+
+if [ -n "$BASELINE" ]; then
+    "$BENCH_DIR/compare.sh" "$BASELINE" "$OUTPUT" "$THRESHOLD"
+fi
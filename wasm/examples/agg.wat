@@ -0,0 +1,95 @@
+(module
+  (memory (export "memory") 4)
+  (global $heap (mut i32) (i32.const 1024))
+  (global $freed (mut i64) (i64.const 0))
+
+  ;; Bump allocator for the row batches and the states, never freed
+  (func $alloc (export "alloc") (param $size i32) (result i32)
+    (local $ptr i32)
+    global.get $heap
+    local.set $ptr
+    local.get $ptr
+    local.get $size
+    i32.add
+    i32.const 7
+    i32.add
+    i32.const -8
+    i32.and
+    global.set $heap
+    local.get $ptr)
+
+  ;; A state holds the sum of the rows at 0 and their count at 8
+  (func $init (result i32)
+    (local $state i32)
+    i32.const 16
+    call $alloc
+    local.set $state
+    local.get $state
+    i64.const 0
+    i64.store
+    local.get $state
+    i64.const 0
+    i64.store offset=8
+    local.get $state)
+
+  (func $step (param $state i32) (param $rows i32) (param $nrows i32)
+    (local $i i32)
+    block
+      loop
+        local.get $i
+        local.get $nrows
+        i32.ge_s
+        br_if 1
+        local.get $state
+        local.get $state
+        i64.load
+        local.get $rows
+        local.get $i
+        i32.const 8
+        i32.mul
+        i32.add
+        i64.load
+        i64.add
+        i64.store
+        local.get $state
+        local.get $state
+        i64.load offset=8
+        i64.const 1
+        i64.add
+        i64.store offset=8
+        local.get $i
+        i32.const 1
+        i32.add
+        local.set $i
+        br 0
+      end
+    end)
+
+  (func (export "sum_final") (param $state i32) (result i64)
+    local.get $state
+    i64.load)
+
+  (func (export "avg_final") (param $state i32) (result f64)
+    local.get $state
+    i64.load
+    f64.convert_i64_s
+    local.get $state
+    i64.load offset=8
+    f64.convert_i64_s
+    f64.div)
+
+  ;; Only counts the states it gets
+  (func (export "sum_free") (param $state i32)
+    global.get $freed
+    i64.const 1
+    i64.add
+    global.set $freed)
+
+  (func (export "freed") (result i64)
+    global.get $freed)
+
+  (export "sum_init" (func $init))
+  (export "sum_step" (func $step))
+  (export "avg_init" (func $init))
+  (export "avg_step" (func $step))
+)
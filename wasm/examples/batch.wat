@@ -0,0 +1,105 @@
+(module
+  (memory (export "memory") 4)
+  (global $heap (mut i32) (i32.const 1024))
+
+  ;; Bump allocator for the buffers of batch calls, never freed
+  (func (export "alloc") (param $size i32) (result i32)
+    (local $ptr i32)
+    global.get $heap
+    local.set $ptr
+    local.get $ptr
+    local.get $size
+    i32.add
+    i32.const 7
+    i32.add
+    i32.const -8
+    i32.and
+    global.set $heap
+    local.get $ptr)
+
+  ;; out[i] = a[i] + b[i], with the columns a and b of nrows i64 values at in
+  (func (export "add_batch") (param $in i32) (param $nrows i32) (param $out i32)
+    (local $i i32)
+    (local $b i32)
+    local.get $in
+    local.get $nrows
+    i32.const 8
+    i32.mul
+    i32.add
+    local.set $b
+    block
+      loop
+        local.get $i
+        local.get $nrows
+        i32.ge_s
+        br_if 1
+        local.get $out
+        local.get $i
+        i32.const 8
+        i32.mul
+        i32.add
+        local.get $in
+        local.get $i
+        i32.const 8
+        i32.mul
+        i32.add
+        i64.load
+        local.get $b
+        local.get $i
+        i32.const 8
+        i32.mul
+        i32.add
+        i64.load
+        i64.add
+        i64.store
+        local.get $i
+        i32.const 1
+        i32.add
+        local.set $i
+        br 0
+      end
+    end)
+
+  ;; The same over i32 columns
+  (func (export "add_batch_i32") (param $in i32) (param $nrows i32) (param $out i32)
+    (local $i i32)
+    (local $b i32)
+    local.get $in
+    local.get $nrows
+    i32.const 4
+    i32.mul
+    i32.add
+    local.set $b
+    block
+      loop
+        local.get $i
+        local.get $nrows
+        i32.ge_s
+        br_if 1
+        local.get $out
+        local.get $i
+        i32.const 4
+        i32.mul
+        i32.add
+        local.get $in
+        local.get $i
+        i32.const 4
+        i32.mul
+        i32.add
+        i32.load
+        local.get $b
+        local.get $i
+        i32.const 4
+        i32.mul
+        i32.add
+        i32.load
+        i32.add
+        i32.store
+        local.get $i
+        i32.const 1
+        i32.add
+        local.set $i
+        br 0
+      end
+    end)
+)
@@ -0,0 +1,82 @@
+(module
+  (memory (export "memory") 8)
+  (global $heap (mut i32) (i32.const 1024))
+
+  ;; Bump allocator for the buffers of bytea and text arguments, never freed
+  (func (export "alloc") (param $size i32) (result i32)
+    (local $ptr i32)
+    global.get $heap
+    local.set $ptr
+    local.get $ptr
+    local.get $size
+    i32.add
+    i32.const 7
+    i32.add
+    i32.const -8
+    i32.and
+    global.set $heap
+    local.get $ptr)
+
+  ;; Number of bytes of the argument
+  (func (export "length") (param $ptr i32) (param $len i32) (result i64)
+    local.get $len
+    i64.extend_i32_u)
+
+  ;; The argument itself, as (ptr << 32 | len)
+  (func (export "echo") (param $ptr i32) (param $len i32) (result i64)
+    local.get $ptr
+    i64.extend_i32_u
+    i64.const 32
+    i64.shl
+    local.get $len
+    i64.extend_i32_u
+    i64.or)
+
+  ;; The argument with its bytes reversed in place
+  (func (export "reverse") (param $ptr i32) (param $len i32) (result i64)
+    (local $i i32)
+    (local $j i32)
+    (local $c i32)
+    local.get $ptr
+    local.set $i
+    local.get $ptr
+    local.get $len
+    i32.add
+    i32.const 1
+    i32.sub
+    local.set $j
+    block
+      loop
+        local.get $i
+        local.get $j
+        i32.ge_s
+        br_if 1
+        local.get $i
+        i32.load8_u
+        local.set $c
+        local.get $i
+        local.get $j
+        i32.load8_u
+        i32.store8
+        local.get $j
+        local.get $c
+        i32.store8
+        local.get $i
+        i32.const 1
+        i32.add
+        local.set $i
+        local.get $j
+        i32.const 1
+        i32.sub
+        local.set $j
+        br 0
+      end
+    end
+    local.get $ptr
+    i64.extend_i32_u
+    i64.const 32
+    i64.shl
+    local.get $len
+    i64.extend_i32_u
+    i64.or)
+)
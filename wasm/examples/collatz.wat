@@ -0,0 +1,36 @@
+(module
+  ;; Number of Collatz steps from n down to 1
+  (func (export "steps") (param $n i64) (result i64)
+    (local $count i64)
+    block
+      loop
+        local.get $n
+        i64.const 1
+        i64.le_s
+        br_if 1
+        local.get $n
+        i64.const 1
+        i64.and
+        i64.eqz
+        if
+          local.get $n
+          i64.const 1
+          i64.shr_s
+          local.set $n
+        else
+          local.get $n
+          i64.const 3
+          i64.mul
+          i64.const 1
+          i64.add
+          local.set $n
+        end
+        local.get $count
+        i64.const 1
+        i64.add
+        local.set $count
+        br 0
+      end
+    end
+    local.get $count)
+)
@@ -0,0 +1,24 @@
+(module
+  (memory (export "memory") 1)
+  (data (i32.const 0) "\0a")
+  (global $n (mut i64) (i64.const 0))
+
+  ;; Number of calls since the instance started
+  (func (export "next") (result i64)
+    global.get $n
+    i64.const 1
+    i64.add
+    global.set $n
+    global.get $n)
+
+  ;; Increment the byte at address 0, which starts at 10, and return it
+  (func (export "bump") (result i32)
+    i32.const 0
+    i32.const 0
+    i32.load8_u
+    i32.const 1
+    i32.add
+    i32.store8
+    i32.const 0
+    i32.load8_u)
+)
@@ -0,0 +1,118 @@
+(module
+  (memory (export "memory") 4)
+  (global $heap (mut i32) (i32.const 1024))
+
+  ;; Bump allocator for the buffers of batch calls, never freed
+  (func (export "alloc") (param $size i32) (result i32)
+    (local $ptr i32)
+    global.get $heap
+    local.set $ptr
+    local.get $ptr
+    local.get $size
+    i32.add
+    i32.const 7
+    i32.add
+    i32.const -8
+    i32.and
+    global.set $heap
+    local.get $ptr)
+
+  ;; out[i] = a[i] / b[i] over two i64 columns, null where b[i] is 0
+  (func (export "safe_div") (param $in i32) (param $nulls i32) (param $nrows i32) (param $out i32)
+    (local $i i32)
+    (local $b i32)
+    (local $divisor i64)
+    local.get $in
+    local.get $nrows
+    i32.const 8
+    i32.mul
+    i32.add
+    local.set $b
+    block
+      loop
+        local.get $i
+        local.get $nrows
+        i32.ge_s
+        br_if 1
+        local.get $nulls
+        local.get $i
+        i32.add
+        i32.load8_u
+        i32.eqz
+        if
+          local.get $b
+          local.get $i
+          i32.const 8
+          i32.mul
+          i32.add
+          i64.load
+          local.set $divisor
+          local.get $divisor
+          i64.eqz
+          if
+            local.get $nulls
+            local.get $i
+            i32.add
+            i32.const 1
+            i32.store8
+          else
+            local.get $out
+            local.get $i
+            i32.const 8
+            i32.mul
+            i32.add
+            local.get $in
+            local.get $i
+            i32.const 8
+            i32.mul
+            i32.add
+            i64.load
+            local.get $divisor
+            i64.div_s
+            i64.store
+          end
+        end
+        local.get $i
+        i32.const 1
+        i32.add
+        local.set $i
+        br 0
+      end
+    end)
+
+  ;; out[i] = x[i] > 0 over an f64 column, one byte per row
+  (func (export "positive") (param $in i32) (param $nulls i32) (param $nrows i32) (param $out i32)
+    (local $i i32)
+    block
+      loop
+        local.get $i
+        local.get $nrows
+        i32.ge_s
+        br_if 1
+        local.get $nulls
+        local.get $i
+        i32.add
+        i32.load8_u
+        i32.eqz
+        if
+          local.get $out
+          local.get $i
+          i32.add
+          local.get $in
+          local.get $i
+          i32.const 8
+          i32.mul
+          i32.add
+          f64.load
+          f64.const 0
+          f64.gt
+          i32.store8
+        end
+        local.get $i
+        i32.const 1
+        i32.add
+        local.set $i
+        br 0
+      end
+    end)
+)
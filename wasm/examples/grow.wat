@@ -0,0 +1,12 @@
+(module
+  (memory (export "memory") 1)
+
+  ;; Grow the memory by the given number of pages, returns the old size or -1
+  (func (export "grow") (param $pages i32) (result i32)
+    local.get $pages
+    memory.grow)
+
+  ;; Size of the memory in pages
+  (func (export "size") (result i32)
+    memory.size)
+)
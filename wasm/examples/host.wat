@@ -0,0 +1,115 @@
+(module
+  (import "pg" "cursor_open" (func $cursor_open (param i32 i32) (result i32)))
+  (import "pg" "cursor_fetch" (func $cursor_fetch (param i32 i32 i32) (result i32)))
+  (import "pg" "cursor_close" (func $cursor_close (param i32)))
+  (import "pg" "emit_rows" (func $emit_rows (param i32 i32)))
+  (import "pg" "log" (func $log (param i32 i32 i32)))
+
+  (memory (export "memory") 1)
+  (data (i32.const 0) "SELECT a::bigint FROM generate_series(1, 100) a")
+  (data (i32.const 128) "SELECT 1 / (a - 5) FROM generate_series(1, 10) a")
+  (data (i32.const 256) "hello from wasm")
+  (global $fetches (mut i32) (i32.const 0))
+
+  ;; Reports a NOTICE
+  (func (export "greet") (result i32)
+    i32.const 3
+    i32.const 256
+    i32.const 15
+    call $log
+    i32.const 0)
+
+  ;; Sum of a bigint query, fetched 10 rows at a time into 1024
+  (func (export "sum_query") (result i64)
+    (local $cursor i32)
+    (local $nrows i32)
+    (local $i i32)
+    (local $sum i64)
+    i32.const 0
+    i32.const 47
+    call $cursor_open
+    local.set $cursor
+    block
+      loop
+        local.get $cursor
+        i32.const 1024
+        i32.const 80
+        call $cursor_fetch
+        local.set $nrows
+        global.get $fetches
+        i32.const 1
+        i32.add
+        global.set $fetches
+        local.get $nrows
+        i32.eqz
+        br_if 1
+        i32.const 0
+        local.set $i
+        block
+          loop
+            local.get $i
+            local.get $nrows
+            i32.ge_s
+            br_if 1
+            local.get $sum
+            i32.const 1024
+            local.get $i
+            i32.const 8
+            i32.mul
+            i32.add
+            i64.load
+            i64.add
+            local.set $sum
+            local.get $i
+            i32.const 1
+            i32.add
+            local.set $i
+            br 0
+          end
+        end
+        br 0
+      end
+    end
+    local.get $cursor
+    call $cursor_close
+    local.get $sum)
+
+  ;; Number of cursor_fetch calls so far
+  (func (export "fetches") (result i32)
+    global.get $fetches)
+
+  ;; Fetch from a query failing at its fifth row
+  (func (export "bad_query") (result i32)
+    i32.const 128
+    i32.const 48
+    call $cursor_open
+    i32.const 1024
+    i32.const 400
+    call $cursor_fetch)
+
+  ;; Rows 2, 4, ..., 2n, emitted one at a time from 2048
+  (func (export "evens") (param $n i32) (result i64)
+    (local $i i32)
+    block
+      loop
+        local.get $i
+        local.get $n
+        i32.ge_s
+        br_if 1
+        local.get $i
+        i32.const 1
+        i32.add
+        local.set $i
+        i32.const 2048
+        local.get $i
+        i32.const 2
+        i32.mul
+        i32.store
+        i32.const 2048
+        i32.const 1
+        call $emit_rows
+        br 0
+      end
+    end
+    i64.const 0)
+)
@@ -0,0 +1,26 @@
+(module
+  ;; Never returns
+  (func (export "spin") (result i32)
+    loop
+      br 0
+    end
+    i32.const 0)
+
+  ;; Loop n times and return the number of iterations
+  (func (export "count") (param $n i64) (result i64)
+    (local $i i64)
+    block
+      loop
+        local.get $i
+        local.get $n
+        i64.ge_s
+        br_if 1
+        local.get $i
+        i64.const 1
+        i64.add
+        local.set $i
+        br 0
+      end
+    end
+    local.get $i)
+)
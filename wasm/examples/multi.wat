@@ -0,0 +1,54 @@
+(module
+  (memory (export "memory") 2)
+
+  ;; Quotient and remainder
+  (func (export "divmod") (param $a i64) (param $b i64) (result i64 i64)
+    local.get $a
+    local.get $b
+    i64.div_s
+    local.get $a
+    local.get $b
+    i64.rem_s)
+
+  ;; Rows (x i32, x * x i64) for x in 1..n, packed at 1024, as (ptr << 32 | nrows)
+  (func (export "squares") (param $n i32) (result i64)
+    (local $i i32)
+    (local $ptr i32)
+    (local $x i64)
+    i32.const 1024
+    local.set $ptr
+    block
+      loop
+        local.get $i
+        local.get $n
+        i32.ge_s
+        br_if 1
+        local.get $i
+        i32.const 1
+        i32.add
+        local.set $i
+        local.get $i
+        i64.extend_i32_s
+        local.set $x
+        local.get $ptr
+        local.get $i
+        i32.store
+        local.get $ptr
+        local.get $x
+        local.get $x
+        i64.mul
+        i64.store offset=4
+        local.get $ptr
+        i32.const 12
+        i32.add
+        local.set $ptr
+        br 0
+      end
+    end
+    i64.const 1024
+    i64.const 32
+    i64.shl
+    local.get $i
+    i64.extend_i32_u
+    i64.or)
+)
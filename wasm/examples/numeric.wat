@@ -0,0 +1,34 @@
+(module
+  (func (export "scale") (param $x f64) (param $k f32) (result f64)
+    local.get $x
+    local.get $k
+    f64.promote_f32
+    f64.mul)
+
+  (func (export "half") (param $x f32) (result f32)
+    local.get $x
+    f32.const 0.5
+    f32.mul)
+
+  (func (export "mul") (param $a i64) (param $b i64) (result i64)
+    local.get $a
+    local.get $b
+    i64.mul)
+
+  ;; Booleans are 0 or 1
+  (func (export "is_even") (param $n i32) (result i32)
+    local.get $n
+    i32.const 1
+    i32.and
+    i32.eqz)
+
+  (func (export "not") (param $b i32) (result i32)
+    local.get $b
+    i32.eqz)
+
+  ;; Timestamps are microseconds since 2000-01-01
+  (func (export "add_day") (param $ts i64) (result i64)
+    local.get $ts
+    i64.const 86400000000
+    i64.add)
+)
@@ -0,0 +1,49 @@
+(module
+  (memory (export "memory") 2)
+  (global $heap (mut i32) (i32.const 1024))
+
+  ;; Bump allocator for the row buffers, never freed
+  (func (export "alloc") (param $size i32) (result i32)
+    (local $ptr i32)
+    global.get $heap
+    local.set $ptr
+    local.get $ptr
+    local.get $size
+    i32.add
+    i32.const 7
+    i32.add
+    i32.const -8
+    i32.and
+    global.set $heap
+    local.get $ptr)
+
+  ;; Rows of (a integer, b bigint, c double precision, t text): the null
+  ;; bitmap padded to 8 bytes, a at 8, b at 12, c at 20, (ptr, len) of t at 28
+
+  ;; a + b + c
+  (func (export "weighted") (param $row i32) (param $len i32) (result f64)
+    local.get $row
+    i32.load offset=8
+    f64.convert_i32_s
+    local.get $row
+    i64.load offset=12
+    f64.convert_i64_s
+    f64.add
+    local.get $row
+    f64.load offset=20
+    f64.add)
+
+  (func (export "nulls") (param $row i32) (param $len i32) (result i32)
+    local.get $row
+    i32.load8_u)
+
+  ;; Offset of the contents of t in the row
+  (func (export "text_offset") (param $row i32) (param $len i32) (result i32)
+    local.get $row
+    i32.load offset=28
+    local.get $row
+    i32.sub)
+
+  (func (export "size") (param $row i32) (param $len i32) (result i32)
+    local.get $len)
+)
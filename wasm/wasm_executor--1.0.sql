@@ -8,7 +8,15 @@ CREATE SCHEMA wasm;
 
 CREATE TABLE wasm.instances(
     id           bigint,
-    wasm_file    text
+    wasm_file    text,
+    version      bigint DEFAULT 1
+);
+
+-- Modules created from bytea, keyed by the md5 of their content
+CREATE TABLE wasm.modules(
+    hash         text PRIMARY KEY,
+    id           bigint,
+    module       bytea
 );
 
 CREATE TABLE wasm.exported_functions(
@@ -47,6 +55,21 @@ RETURNS int8
 AS 'MODULE_PATHNAME', 'wasm_create_instance_wat'
 LANGUAGE C STRICT;
 
+CREATE FUNCTION wasm_create_new_instance_bytea(bytea)
+RETURNS int8
+AS 'MODULE_PATHNAME', 'wasm_create_instance_bytea'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION wasm_reload_module(int8, text, int8)
+RETURNS text
+AS 'MODULE_PATHNAME', 'wasm_reload_module'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION wasm_reload_module_bytea(int8, bytea, int8)
+RETURNS text
+AS 'MODULE_PATHNAME', 'wasm_reload_module_bytea'
+LANGUAGE C STRICT;
+
 CREATE FUNCTION wasm_drop_instance(int8)
 RETURNS text
 AS 'MODULE_PATHNAME', 'wasm_drop_instance'
@@ -107,68 +130,155 @@ RETURNS int8
 AS 'MODULE_PATHNAME', 'wasm_invoke_function_10'
 LANGUAGE C STRICT;
 
-CREATE OR REPLACE FUNCTION wasm_new_instance(module_pathname text, namespace text) RETURNS text AS $$
+CREATE FUNCTION wasm_invoke_batch(text, text, int8[])
+RETURNS int8[]
+AS 'MODULE_PATHNAME', 'wasm_invoke_batch'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION wasm_invoke_batch(text, text, int8[], int8[])
+RETURNS int8[]
+AS 'MODULE_PATHNAME', 'wasm_invoke_batch'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION wasm_invoke_batch(text, text, int8[], int8[], int8[])
+RETURNS int8[]
+AS 'MODULE_PATHNAME', 'wasm_invoke_batch'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION wasm_invoke_batch(text, text, int8[], int8[], int8[], int8[])
+RETURNS int8[]
+AS 'MODULE_PATHNAME', 'wasm_invoke_batch'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION wasm_stat_functions(
+    OUT instanceid   bigint,
+    OUT funcname     text,
+    OUT calls        bigint,
+    OUT traps        bigint,
+    OUT total_time   float8,
+    OUT self_time    float8,
+    OUT bytes_in     bigint,
+    OUT bytes_out    bigint,
+    OUT memo_hits    bigint,
+    OUT memo_misses  bigint,
+    OUT latency_hist bigint[]
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'wasm_stat_functions'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION wasm_stat_modules(
+    OUT instanceid          bigint,
+    OUT wasm_file           text,
+    OUT version             bigint,
+    OUT compile_time        float8,
+    OUT compiled_from_cache boolean,
+    OUT instantiations      bigint,
+    OUT instantiate_time    float8,
+    OUT tier                text,
+    OUT tier_up             text,
+    OUT tier_up_time        float8,
+    OUT instances           bigint,
+    OUT memory_bytes        bigint,
+    OUT evictions           bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'wasm_stat_modules'
+LANGUAGE C STRICT;
+
+CREATE VIEW wasm.stat_functions AS SELECT * FROM wasm_stat_functions();
+
+CREATE VIEW wasm.stat_modules AS SELECT * FROM wasm_stat_modules();
+
+CREATE FUNCTION wasm_engine_config(
+    OUT name    text,
+    OUT setting text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'wasm_engine_config'
+LANGUAGE C STRICT;
+
+CREATE VIEW wasm.engine_config AS SELECT * FROM wasm_engine_config();
+
+CREATE FUNCTION wasm_profile_dump()
+RETURNS text
+AS 'MODULE_PATHNAME', 'wasm_profile_dump'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION wasm_call_handler()
+RETURNS language_handler
+AS 'MODULE_PATHNAME', 'wasm_call_handler'
+LANGUAGE C;
+
+CREATE LANGUAGE wasm HANDLER wasm_call_handler;
+
+CREATE OR REPLACE FUNCTION wasm_register_instance(
+    current_instance_id int8,
+    namespace text,
+    volatility text,
+    parallel_safety text
+) RETURNS text AS $$
 DECLARE
-    current_instance_id int8;
     exported_function RECORD;
     exported_function_generated_inputs text;
     exported_function_generated_outputs text;
 BEGIN
-    -- Create a new instance, and stores its ID in `current_instance_id`.
-    SELECT wasm_create_new_instance(module_pathname) INTO STRICT current_instance_id;
-   
+    -- The generated functions carry these properties, so the planner may fold,
+    -- share or parallelize calls of pure exports.
+    volatility := lower(volatility);
+    parallel_safety := lower(parallel_safety);
+    IF volatility NOT IN ('immutable', 'stable', 'volatile') THEN
+        RAISE EXCEPTION 'wasm_executor: invalid volatility "%"', volatility;
+    END IF;
+    IF parallel_safety NOT IN ('safe', 'restricted', 'unsafe') THEN
+        RAISE EXCEPTION 'wasm_executor: invalid parallel safety "%"', parallel_safety;
+    END IF;
+
     -- Insert the wasm information to gloable table 
     INSERT INTO wasm.instances SELECT id, wasm_file FROM wasm_get_instances() WHERE id = current_instance_id;
     INSERT INTO wasm.exported_functions SELECT current_instance_id, namespace, funcname, inputs, outputs FROM wasm_get_exported_functions(current_instance_id);
     
     -- Generate functions for each exported functions from the WebAssembly instance.
+    -- They are handled by LANGUAGE wasm, so a call goes straight from fmgr into the instance.
     FOR
         exported_function
     IN
         SELECT
             funcname,
             inputs,
-            CASE
-                WHEN length(inputs) = 0 THEN 0
-                ELSE array_length(regexp_split_to_array(inputs, ','), 1)
-            END AS input_arity,
             outputs
         FROM
             (SELECT * FROM wasm_get_exported_functions(current_instance_id))
     LOOP
-        IF exported_function.input_arity > 10 THEN
-           RAISE EXCEPTION 'WebAssembly exported function `%` has an arity greater than 10, which is not supported yet.', exported_function.funcname;
-        END IF;
-
-        exported_function_generated_inputs := '';
+        exported_function_generated_inputs := exported_function.inputs;
         exported_function_generated_outputs := '';
 
-        FOR nth IN 1..exported_function.input_arity LOOP
-            exported_function_generated_inputs := exported_function_generated_inputs || format(', CAST($%s AS int8)', nth);
-        END LOOP;
-
-        IF length(exported_function.outputs) > 0 THEN
+        IF position(',' IN exported_function.outputs) > 0 THEN
+            -- A multi-value export returns one record, with an OUT parameter per result.
+            SELECT
+                concat_ws(', ', nullif(exported_function.inputs, ''),
+                    string_agg(format('OUT r%s %s', i, results[i]), ', ' ORDER BY i))
+            INTO
+                exported_function_generated_inputs
+            FROM
+                (SELECT string_to_array(exported_function.outputs, ',') AS results) r,
+                generate_subscripts(r.results, 1) AS i;
+            exported_function_generated_outputs := 'record';
+        ELSIF length(exported_function.outputs) > 0 THEN
             exported_function_generated_outputs := exported_function.outputs;
         ELSE
             exported_function_generated_outputs := 'integer';
         END IF;
 
         EXECUTE format(
-            'CREATE OR REPLACE FUNCTION %I_%I(%3$s) RETURNS %5$s AS $F$' ||
-            'DECLARE' ||
-            '    output %5$s;' ||
-            'BEGIN' ||
-            '    SELECT wasm_invoke_function_%4$s(%6$L, %2$L%7$s) INTO STRICT output;' ||
-            '    RETURN output;' ||
-            'END;' ||
-            '$F$ LANGUAGE plpgsql;',
+            'CREATE OR REPLACE FUNCTION %I_%I(%3$s) RETURNS %4$s AS %5$L LANGUAGE wasm STRICT %6$s PARALLEL %7$s;',
             namespace, -- 1
             exported_function.funcname, -- 2
-            exported_function.inputs, -- 3
-            exported_function.input_arity, -- 4
-            exported_function_generated_outputs, -- 5
-            current_instance_id, -- 6
-            exported_function_generated_inputs -- 7
+            exported_function_generated_inputs, -- 3
+            exported_function_generated_outputs, -- 4
+            current_instance_id || ':' || exported_function.funcname, -- 5
+            volatility, -- 6
+            parallel_safety -- 7
         );
     END LOOP;
 
@@ -176,75 +286,92 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql;
 
-CREATE OR REPLACE FUNCTION wasm_new_instance_wat(module_pathname text, namespace text) RETURNS text AS $$
+CREATE OR REPLACE FUNCTION wasm_new_instance(
+    module_pathname text,
+    namespace text,
+    volatility text DEFAULT 'volatile',
+    parallel_safety text DEFAULT 'unsafe'
+) RETURNS text AS $$
 DECLARE
     current_instance_id int8;
-    exported_function RECORD;
-    exported_function_generated_inputs text;
-    exported_function_generated_outputs text;
 BEGIN
     -- Create a new instance, and stores its ID in `current_instance_id`.
-    SELECT wasm_create_new_instance_wat(module_pathname) INTO STRICT current_instance_id;
-   
-    -- Insert the wasm information to gloable table 
-    INSERT INTO wasm.instances SELECT id, wasm_file FROM wasm_get_instances() WHERE id = current_instance_id;
-    INSERT INTO wasm.exported_functions SELECT current_instance_id, namespace, funcname, inputs, outputs FROM wasm_get_exported_functions(current_instance_id);
-    
-    -- Generate functions for each exported functions from the WebAssembly instance.
-    FOR
-        exported_function
-    IN
-        SELECT
-            funcname,
-            inputs,
-            CASE
-                WHEN length(inputs) = 0 THEN 0
-                ELSE array_length(regexp_split_to_array(inputs, ','), 1)
-            END AS input_arity,
-            outputs
-        FROM
-            (SELECT * FROM wasm_get_exported_functions(current_instance_id))
-    LOOP
-        IF exported_function.input_arity > 10 THEN
-           RAISE EXCEPTION 'WebAssembly exported function `%` has an arity greater than 10, which is not supported yet.', exported_function.funcname;
-        END IF;
-
-        exported_function_generated_inputs := '';
-        exported_function_generated_outputs := '';
-
-        FOR nth IN 1..exported_function.input_arity LOOP
-            exported_function_generated_inputs := exported_function_generated_inputs || format(', CAST($%s AS int8)', nth);
-        END LOOP;
+    SELECT wasm_create_new_instance(module_pathname) INTO STRICT current_instance_id;
+    RETURN wasm_register_instance(current_instance_id, namespace, volatility, parallel_safety);
+END;
+$$ LANGUAGE plpgsql;
 
-        IF length(exported_function.outputs) > 0 THEN
-            exported_function_generated_outputs := exported_function.outputs;
-        ELSE
-            exported_function_generated_outputs := 'integer';
-        END IF;
+CREATE OR REPLACE FUNCTION wasm_new_instance_wat(
+    module_pathname text,
+    namespace text,
+    volatility text DEFAULT 'volatile',
+    parallel_safety text DEFAULT 'unsafe'
+) RETURNS text AS $$
+DECLARE
+    current_instance_id int8;
+BEGIN
+    -- Create a new instance, and stores its ID in `current_instance_id`.
+    SELECT wasm_create_new_instance_wat(module_pathname) INTO STRICT current_instance_id;
+    RETURN wasm_register_instance(current_instance_id, namespace, volatility, parallel_safety);
+END;
+$$ LANGUAGE plpgsql;
 
-        EXECUTE format(
-            'CREATE OR REPLACE FUNCTION %I_%I(%3$s) RETURNS %5$s AS $F$' ||
-            'DECLARE' ||
-            '    output %5$s;' ||
-            'BEGIN' ||
-            '    SELECT wasm_invoke_function_%4$s(%6$L, %2$L%7$s) INTO STRICT output;' ||
-            '    RETURN output;' ||
-            'END;' ||
-            '$F$ LANGUAGE plpgsql;',
-            namespace, -- 1
-            exported_function.funcname, -- 2
-            exported_function.inputs, -- 3
-            exported_function.input_arity, -- 4
-            exported_function_generated_outputs, -- 5
-            current_instance_id, -- 6
-            exported_function_generated_inputs -- 7
-        );
-    END LOOP;
+CREATE OR REPLACE FUNCTION wasm_new_instance_bytea(
+    module bytea,
+    namespace text,
+    volatility text DEFAULT 'volatile',
+    parallel_safety text DEFAULT 'unsafe'
+) RETURNS text AS $$
+DECLARE
+    current_instance_id int8;
+BEGIN
+    -- The module is stored in wasm.modules, so it is WAL-logged and standbys
+    -- load it from there on first use.
+    SELECT wasm_create_new_instance_bytea(module) INTO STRICT current_instance_id;
+    INSERT INTO wasm.modules SELECT md5(module), current_instance_id, module
+        WHERE NOT EXISTS (SELECT 1 FROM wasm.modules WHERE id = current_instance_id);
+    RETURN wasm_register_instance(current_instance_id, namespace, volatility, parallel_safety);
+END;
+$$ LANGUAGE plpgsql;
 
-    RETURN current_instance_id;
+CREATE OR REPLACE FUNCTION wasm_reload_instance(
+    instance_id int8,
+    module_pathname text
+) RETURNS int8 AS $$
+DECLARE
+    current_version int8;
+    new_wasm_file text;
+BEGIN
+    -- The row lock serializes concurrent reloads of the same instance. The new
+    -- version is compiled now and replaces the running one at commit, while
+    -- calls keep going to the old one.
+    SELECT version INTO STRICT current_version FROM wasm.instances WHERE id = instance_id FOR UPDATE;
+    SELECT wasm_reload_module(instance_id, module_pathname, current_version + 1) INTO STRICT new_wasm_file;
+    UPDATE wasm.instances SET wasm_file = new_wasm_file, version = current_version + 1 WHERE id = instance_id;
+    DELETE FROM wasm.modules WHERE id = instance_id;
+    RETURN current_version + 1;
 END;
 $$ LANGUAGE plpgsql;
 
+CREATE OR REPLACE FUNCTION wasm_reload_instance_bytea(
+    instance_id int8,
+    module bytea
+) RETURNS int8 AS $$
+DECLARE
+    current_version int8;
+    new_wasm_file text;
+BEGIN
+    SELECT version INTO STRICT current_version FROM wasm.instances WHERE id = instance_id FOR UPDATE;
+    IF EXISTS (SELECT 1 FROM wasm.modules WHERE hash = md5(module) AND id <> instance_id) THEN
+        RAISE EXCEPTION 'wasm_executor: module is already registered as another instance';
+    END IF;
+    SELECT wasm_reload_module_bytea(instance_id, module, current_version + 1) INTO STRICT new_wasm_file;
+    UPDATE wasm.instances SET wasm_file = new_wasm_file, version = current_version + 1 WHERE id = instance_id;
+    DELETE FROM wasm.modules WHERE id = instance_id;
+    INSERT INTO wasm.modules VALUES (md5(module), instance_id, module);
+    RETURN current_version + 1;
+END;
+$$ LANGUAGE plpgsql;
 
 CREATE OR REPLACE FUNCTION wasm_delete_instance(delete_instance int8) RETURNS text AS $$
 DECLARE
@@ -276,6 +403,7 @@ BEGIN
 
     DELETE FROM wasm.instances WHERE id = delete_instance;
     DELETE FROM wasm.exported_functions WHERE instanceid = delete_instance;
+    DELETE FROM wasm.modules WHERE id = delete_instance;
 
     RETURN instance_module_path;
 END;
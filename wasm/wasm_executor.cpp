@@ -4,18 +4,73 @@
 #include "access/hash.h"
 #include "miscadmin.h"
 #include "funcapi.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "utils/syscache.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+#include "access/xact.h"
+#include "utils/array.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+#include "utils/typcache.h"
+#include "nodes/execnodes.h"
+#include "mb/pg_wchar.h"
+#include "libpq/md5.h"
+#include "executor/spi.h"
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <signal.h>
+#include <time.h>
 #include <map>
+#include <algorithm>
 
 #include "wasm.h"
 #include "wasmtime.h"
 
 PG_MODULE_MAGIC;
 
+#define WASM_ENGINE_VERSION "wasmtime-15.0.1"
+#define WASM_CACHE_DIR "wasm_cache"
+#define WASM_CACHE_SUFFIX ".cwasm"
+#define WASM_PROFILE_DIR "wasm_profile"
+#define WASM_MD5_HEX_LEN 32
+// Name of a module created from bytea, followed by its md5
+#define WASM_CATALOG_PREFIX "wasm.modules/"
+#define WASM_MEMORY_EXPORT "memory"
+#define WASM_ALLOC_EXPORT "alloc"
+#define WASM_DEALLOC_EXPORT "dealloc"
+#define WASM_HOST_MODULE "pg"
+#define WASM_SCRATCH_MIN_SIZE 65536
+#define WASM_EPOCH_TICK_MS 10
+#define WASM_NO_DEADLINE ((uint64)PG_INT64_MAX)
+#define WASM_STAT_BUCKETS 32
+#define WASM_AGG_BATCH_ROWS 1024
+#define WASM_AGG_INIT_SUFFIX "_init"
+#define WASM_AGG_STEP_SUFFIX "_step"
+#define WASM_AGG_FINAL_SUFFIX "_final"
+#define WASM_AGG_FREE_SUFFIX "_free"
+// Arguments and results larger than this are not memoized
+#define WASM_MEMO_MAX_BYTES 8192
+
 extern "C" Datum wasm_create_instance_wat(PG_FUNCTION_ARGS);
 extern "C" Datum wasm_create_instance(PG_FUNCTION_ARGS);
+extern "C" Datum wasm_create_instance_bytea(PG_FUNCTION_ARGS);
 extern "C" Datum wasm_drop_instance(PG_FUNCTION_ARGS);
+extern "C" Datum wasm_reload_module(PG_FUNCTION_ARGS);
+extern "C" Datum wasm_reload_module_bytea(PG_FUNCTION_ARGS);
 extern "C" Datum wasm_get_instances(PG_FUNCTION_ARGS);
 extern "C" Datum wasm_get_exported_functions(PG_FUNCTION_ARGS);
 extern "C" Datum wasm_invoke_function_0(PG_FUNCTION_ARGS);
@@ -29,67 +84,580 @@ extern "C" Datum wasm_invoke_function_7(PG_FUNCTION_ARGS);
 extern "C" Datum wasm_invoke_function_8(PG_FUNCTION_ARGS);
 extern "C" Datum wasm_invoke_function_9(PG_FUNCTION_ARGS);
 extern "C" Datum wasm_invoke_function_10(PG_FUNCTION_ARGS);
+extern "C" Datum wasm_invoke_batch(PG_FUNCTION_ARGS);
+extern "C" Datum wasm_call_handler(PG_FUNCTION_ARGS);
+extern "C" Datum wasm_stat_functions(PG_FUNCTION_ARGS);
+extern "C" Datum wasm_stat_modules(PG_FUNCTION_ARGS);
+extern "C" Datum wasm_engine_config(PG_FUNCTION_ARGS);
+extern "C" Datum wasm_profile_dump(PG_FUNCTION_ARGS);
+extern "C" void set_extension_index(uint32 index);
+extern "C" void init_session_vars(void);
+extern "C" void _PG_init(void);
+
+/*
+ * Call descriptor of an exported function. The descriptors of a module are
+ * built once when it is registered, so an invocation never has to look up the
+ * export or inspect its type again.
+ */
+typedef struct WasmFuncInfo {
+    std::string funcname;
+    std::string inputs;
+    std::string outputs;
+
+    // Position in WasmModuleInfo::functions and WasmInstInfo::funcs
+    int index;
+    std::vector<wasm_valkind_t> params;
+    std::vector<wasm_valkind_t> results;
+    // Slots needed by wasmtime_func_call_unchecked, max(params, results)
+    size_t nraw;
+    // Whether the signature maps to a scalar SQL function
+    bool sqlcallable;
+} WasmFuncInfo;
+
+/*
+ * Progress of the optimized compile of a module first compiled at baseline
+ * level, see wasm.tiered_compilation.
+ */
+typedef enum WasmTierUp {
+    WASM_TIER_UP_NONE,
+    WASM_TIER_UP_COMPILING,
+    WASM_TIER_UP_DONE,
+    WASM_TIER_UP_FAILED
+} WasmTierUp;
+
+/*
+ * A registered module. It holds the compiled code and the call descriptors,
+ * both shared by every session, and is never modified once published, except
+ * for the tier-up fields the background compile fills in.
+ */
+typedef struct WasmModuleInfo {
+    int64 id;
+
+    std::string wasm_file;
+
+    // Bumped by every reload, see wasm_reload_module
+    int64 version;
+
+    wasmtime_module_t *wasm_module;
+    // Engine wasm_module was compiled by, the baseline one under tiered compilation
+    wasm_engine_t *engine;
+
+    // Code of the optimized engine and its compile time, written once by the
+    // background compile before the release store of WASM_TIER_UP_DONE into
+    // tier_up. Read them only after an acquire load of tier_up returns DONE.
+    std::atomic<int> tier_up;
+    wasmtime_module_t *optimized_module;
+    uint64 tier_up_ns;
 
+    std::vector<WasmFuncInfo*> functions;
+
+    std::unordered_map<std::string, WasmFuncInfo*> function_index;
+
+    // Guest allocator used to place buffers in linear memory, may be NULL
+    WasmFuncInfo *alloc_func;
+    WasmFuncInfo *dealloc_func;
+
+    // Compilation is timed once, instantiations by every thread
+    uint64 compile_ns;
+    bool compiled_from_cache;
+    std::atomic<uint64> instantiations;
+    std::atomic<uint64> instantiate_ns;
+    // Instances stopped by wasm.session_memory_budget
+    std::atomic<uint64> evictions;
+
+    WasmModuleInfo() : id(0), version(1), wasm_module(NULL), engine(NULL), tier_up(WASM_TIER_UP_NONE),
+        optimized_module(NULL), tier_up_ns(0), alloc_func(NULL), dealloc_func(NULL), compile_ns(0),
+        compiled_from_cache(false), instantiations(0), instantiate_ns(0),
+        evictions(0) {}
+
+    ~WasmModuleInfo()
+    {
+        for (WasmFuncInfo *funcinfo : functions) {
+            delete funcinfo;
+        }
+        if (wasm_module != NULL) {
+            wasmtime_module_delete(wasm_module);
+        }
+        if (optimized_module != NULL) {
+            wasmtime_module_delete(optimized_module);
+        }
+    }
+} WasmModuleInfo;
+
+typedef std::unordered_map<int64, std::shared_ptr<WasmModuleInfo>> WasmModuleMap;
+
+/*
+ * Execution counters of one export. Only the thread owning the slot writes
+ * them, with plain relaxed loads and stores, and readers sum all slots.
+ */
+typedef struct WasmFuncStats {
+    std::atomic<uint64> calls;
+    std::atomic<uint64> traps;
+    std::atomic<uint64> total_ns;
+    std::atomic<uint64> self_ns;
+    std::atomic<uint64> bytes_in;
+    std::atomic<uint64> bytes_out;
+    std::atomic<uint64> memo_hits;
+    std::atomic<uint64> memo_misses;
+    // Calls sampled by wasm.profile_sample_rate, their time from entering the
+    // call handler to returning, and the part of it spent in the guest
+    std::atomic<uint64> sampled_calls;
+    std::atomic<uint64> sampled_ns;
+    std::atomic<uint64> sampled_guest_ns;
+    // Bucket i counts calls that took [2^i, 2^(i+1)) ns, the last one is open
+    std::atomic<uint64> latency[WASM_STAT_BUCKETS];
+} WasmFuncStats;
+
+/*
+ * Counters of one thread's instance of a module, one entry per export.
+ */
+typedef struct WasmStatSlot {
+    std::shared_ptr<WasmModuleInfo> module;
+    std::unique_ptr<WasmFuncStats[]> funcs;
+    // Whether the instance has a store, and its linear memory when last measured
+    std::atomic<bool> running;
+    std::atomic<uint64> memory_bytes;
+} WasmStatSlot;
+
+/*
+ * An instance of a module owned by one thread. Stores are not thread safe, so
+ * every thread running wasm gets its own store and instance, created lazily
+ * from the shared module.
+ */
 typedef struct WasmInstInfo {
-    wasm_engine_t *wasm_engine;
+    std::shared_ptr<WasmModuleInfo> module;
 
     wasmtime_store_t *wasm_store;
 
-    wasmtime_module_t *wasm_module;
+    wasmtime_context_t *wasm_context;
 
     wasmtime_instance_t instance;
 
-    std::string wasm_file;
+    // Exported functions of this instance, indexed by WasmFuncInfo::index
+    std::vector<wasmtime_func_t> funcs;
+
+    bool has_memory;
+    wasmtime_memory_t memory;
+
+    // Region of linear memory reused by every call to marshal buffers
+    uint32 scratch_ptr;
+    uint32 scratch_size;
+
+    // Reset epoch of the session the instance was last checked out in
+    uint64 epoch;
+    bool used;
+
+    std::shared_ptr<WasmStatSlot> stat_slot;
+    // stat_slot->funcs, indexed by WasmFuncInfo::index
+    WasmFuncStats *stats;
+
+    // Number of times the instance was started, guest pointers held across
+    // calls are only valid while it does not change
+    uint64 starts;
+
+    // Whether the instance runs baseline code, to be replaced once optimized
+    bool baseline;
+
+    // Value of the session's checkout_clock when last checked out, for eviction
+    uint64 last_checkout;
+
+    // Aggregate states whose memory context went away, with their _free export,
+    // released at the next checkout as no guest code may run in a reset callback
+    std::vector<std::pair<WasmFuncInfo*, uint32>> pending_frees;
 } WasmInstInfo;
 
+/*
+ * Memoized result of an IMMUTABLE function, keyed by its argument bytes.
+ * bytea and text results are kept in data, others in value.
+ */
+typedef struct WasmMemoEntry {
+    std::string key;
+    Datum value;
+    std::string data;
+    // Second chance bit of the CLOCK eviction
+    bool referenced;
+} WasmMemoEntry;
+
+/*
+ * Bounded result cache of one function in one session, see wasm.memoize_entries.
+ * It belongs to the export it was filled from, and is emptied when the
+ * function is bound to another one, e.g. after the module was dropped.
+ */
+typedef struct WasmMemoCache {
+    std::weak_ptr<WasmModuleInfo> module;
+    WasmFuncInfo *funcinfo;
+    size_t capacity;
+    std::vector<WasmMemoEntry> entries;
+    std::unordered_map<std::string, size_t> index;
+    size_t hand;
+} WasmMemoCache;
+
+/*
+ * Instances owned by the current thread. generation changes whenever one of
+ * them goes away, so that pointers cached in fn_extra can be revalidated.
+ */
+typedef struct WasmSessionState {
+    std::unordered_map<int64, WasmInstInfo*> instances;
+    uint64 generation;
+    uint64 registry_generation;
+    // Bumped at the end of each statement or transaction, see wasm.instance_reset
+    uint64 reset_epoch;
+    TimestampTz statement_start;
+    // Epoch tick at which the current statement hits statement_timeout
+    TimestampTz deadline_statement;
+    int deadline_timeout;
+    uint64 statement_deadline;
+    // Deadline of the last call, and whether it came from wasm.call_timeout
+    uint64 armed_deadline;
+    bool call_deadline;
+    // Set when wasm_epoch_callback stops the running call
+    bool epoch_stopped;
+    // Time spent in nested calls of the running call, to derive self time
+    uint64 stat_child_ns;
+    // Guest time of the last timed call, and whether the running call is sampled
+    uint64 last_call_ns;
+    bool profile_call;
+    int profile_countdown;
+    // Cursors opened or found by the guest in this transaction, by handle
+    std::vector<std::string> cursors;
+    // Result set pg.emit_rows appends to, while a set-returning function runs
+    struct WasmCallCache *emit_cache;
+    Tuplestorestate *emit_store;
+    // ERROR raised by a host import, rethrown once the guest has unwound
+    ErrorData *host_error;
+    // Host imports running, whose callers may not lose their instance
+    int host_depth;
+    // openGauss session the thread currently serves, see wasm_get_session
+    uint64 session_id;
+    // Result caches of IMMUTABLE functions by function oid
+    std::unordered_map<Oid, WasmMemoCache*> memos;
+    // Counts checkouts, and its value when the last transaction ended
+    uint64 checkout_clock;
+    uint64 xact_clock;
+} WasmSessionState;
+
+typedef enum WasmInstanceReset {
+    WASM_RESET_NONE,
+    WASM_RESET_STATEMENT,
+    WASM_RESET_TRANSACTION
+} WasmInstanceReset;
+
+/*
+ * Settings the engine was created with, from the wasm.* GUCs of the same
+ * names. They hold for the life of the process, as all modules share the
+ * engine. Sizes are in kB.
+ */
+typedef struct WasmEngineSettings {
+    bool fuel;
+    int opt_level;
+    bool parallel_compilation;
+    bool simd;
+    bool bulk_memory;
+    int static_memory_maximum_size;
+    int static_memory_guard_size;
+    int dynamic_memory_guard_size;
+    int profiler;
+} WasmEngineSettings;
+
+/*
+ * Session level GUC variables, stored in extension_session_vars_array as
+ * openGauss sessions are not bound to a process.
+ */
+typedef struct WasmSessionContext {
+    int instance_reset;
+    int call_timeout;
+    bool fuel_metering;
+    int fuel_per_call;
+    bool track_functions;
+    int memoize_entries;
+    int profile_sample_rate;
+    bool tiered_compilation;
+    int max_memory;
+    int max_table_elements;
+    int session_memory_budget;
+    char *preload_modules;
+    // Engine settings, only read when the engine is created
+    WasmEngineSettings engine;
+} WasmSessionContext;
+
 typedef struct TupleInstanceState {
     TupleDesc tupd;
-    std::map<int64, WasmInstInfo*>::iterator currindex;
-    std::map<int64, WasmInstInfo*>::iterator lastindex;
+    int64 *ids;
+    char **files;
 } TupleInstanceState;
 
-typedef struct WasmFuncInfo {
-    std::string funcname;
-    std::string inputs;
-    std::string outputs;
-} WasmFuncInfo;
-
 typedef struct TupleFuncState {
     TupleDesc tupd;
-    std::vector<WasmFuncInfo*>::iterator currindex;
-    std::vector<WasmFuncInfo*>::iterator lastindex;
+    char **funcnames;
+    char **inputs;
+    char **outputs;
 } TupleFuncState;
 
-// Store the wasm instance info globally 
-static std::map<int64, WasmInstInfo*> instances; 
+// The engine shared by all modules, created on first use
+static wasm_engine_t *wasm_engine = NULL;
+// Engine without optimizations for the first tier, created on first use
+static std::atomic<wasm_engine_t*> wasm_baseline_engine(NULL);
+// Host imports, defined once per engine and shared by all instances
+static std::map<wasm_engine_t*, wasmtime_linker_t*> wasm_linkers;
+static std::mutex wasm_engine_lock;
+static WasmEngineSettings wasm_engine_settings;
 
-// Store the wasm exported function info globally
-static std::map<int64, std::vector<WasmFuncInfo *>*> exported_functions;
+/*
+ * Ticks of the engine epoch, advanced every WASM_EPOCH_TICK_MS by a thread
+ * started with the engine. Guest code checks the epoch at function entries and
+ * loop headers, which is much cheaper than fuel metering every instruction.
+ */
+static std::atomic<uint64> wasm_epoch_ticks(0);
 
-static WasmInstInfo* find_instance(int64 instanceid)
+/*
+ * Registered modules. Readers take a snapshot with atomic_load and never block
+ * each other; writers serialize on wasm_modules_lock, copy the map and publish
+ * the new one, RCU style. wasm_registry_generation is bumped on every publish.
+ */
+static std::shared_ptr<const WasmModuleMap> wasm_modules = std::make_shared<const WasmModuleMap>();
+static std::mutex wasm_modules_lock;
+static std::atomic<uint64> wasm_registry_generation(1);
+
+// New module versions by openGauss session, published when its transaction commits
+static std::map<uint64, std::vector<std::shared_ptr<WasmModuleInfo>>> wasm_pending_reloads;
+static std::atomic<uint64> wasm_pending_count(0);
+static std::mutex wasm_pending_lock;
+
+// Statistics slots of all threads, see WasmStatSlot
+static std::vector<std::shared_ptr<WasmStatSlot>> wasm_stat_slots;
+static std::mutex wasm_stat_lock;
+
+// Instances of the current thread
+static THR_LOCAL WasmSessionState *wasm_session = NULL;
+// Frees the state of a thread when it exits
+static pthread_key_t wasm_session_key;
+static pthread_once_t wasm_session_key_once = PTHREAD_ONCE_INIT;
+
+static uint32 wasm_extension_index;
+
+static const struct config_enum_entry wasm_instance_reset_options[] = {
+    {"none", WASM_RESET_NONE, false},
+    {"statement", WASM_RESET_STATEMENT, false},
+    {"transaction", WASM_RESET_TRANSACTION, false},
+    {NULL, 0, false}
+};
+
+static const struct config_enum_entry wasm_opt_level_options[] = {
+    {"none", WASMTIME_OPT_LEVEL_NONE, false},
+    {"speed", WASMTIME_OPT_LEVEL_SPEED, false},
+    {"speed_and_size", WASMTIME_OPT_LEVEL_SPEED_AND_SIZE, false},
+    {NULL, 0, false}
+};
+
+static const struct config_enum_entry wasm_profiler_options[] = {
+    {"none", WASMTIME_PROFILING_STRATEGY_NONE, false},
+    {"jitdump", WASMTIME_PROFILING_STRATEGY_JITDUMP, false},
+    {"vtune", WASMTIME_PROFILING_STRATEGY_VTUNE, false},
+    {NULL, 0, false}
+};
+
+/*
+ * How the call handler maps a LANGUAGE wasm function onto the module, chosen
+ * from the argument and result types of the function.
+ */
+typedef enum WasmCallMode {
+    WASM_CALL_SCALAR,
+    // Composite result, one column per result of a multi-value export
+    WASM_CALL_COMPOSITE,
+    // Set-returning function, all rows produced by one guest call
+    WASM_CALL_SRF,
+    // Array arguments and result, run through the batch entry point
+    WASM_CALL_BATCH,
+    // Transition and final functions of an aggregate
+    WASM_CALL_AGG_TRANS,
+    WASM_CALL_AGG_FINAL
+} WasmCallMode;
+
+/*
+ * Exports implementing an aggregate, named after the prefix given in the
+ * function body: <prefix>_init, _step, _final and _free.
+ */
+typedef struct WasmAggFuncs {
+    WasmFuncInfo *init;
+    WasmFuncInfo *step;
+    WasmFuncInfo *final;
+    WasmFuncInfo *free;
+} WasmAggFuncs;
+
+/*
+ * Per-FmgrInfo state of a LANGUAGE wasm function. It is built on the first call
+ * and hung off fn_extra, so later calls go straight to the call descriptor.
+ */
+typedef struct WasmCallCache {
+    WasmSessionState *session;
+    uint64 generation;
+    uint64 registry_generation;
+    WasmInstInfo *instinfo;
+    WasmFuncInfo *funcinfo;
+    int nargs;
+    Oid argtypes[FUNC_MAX_ARGS];
+    Oid rettype;
+    WasmCallMode mode;
+    WasmAggFuncs agg;
+    Oid elemtypes[FUNC_MAX_ARGS];
+    Oid retelemtype;
+    // First wasm parameter of each argument, bytea, text and rows take (ptr, len)
+    int argslots[FUNC_MAX_ARGS];
+    // Whole-row and composite arguments, packed by wasm_pack_row
+    bool rowargs[FUNC_MAX_ARGS];
+    bool has_buffers;
+    bool retset;
+    // Blessed row type of composite and set-returning functions
+    TupleDesc tupdesc;
+    // Bytes per row in the result buffer of a set-returning function
+    int rowwidth;
+    // Batch export taking the null flags of the rows, see wasm_call_batch
+    bool batch_nulls;
+    // IMMUTABLE scalar function, whose results may be memoized
+    bool memoizable;
+    WasmMemoCache *memo;
+} WasmCallCache;
+
+/*
+ * One input column of a batch call: nrows values of width bytes each.
+ */
+typedef struct WasmBatchColumn {
+    const char *data;
+    int width;
+} WasmBatchColumn;
+
+/*
+ * Transition state of a wasm aggregate. The state itself lives in linear
+ * memory at guest_state; the host only buffers input rows, column by column,
+ * and hands them to <prefix>_step in batches.
+ */
+typedef struct WasmAggState {
+    WasmInstInfo *instinfo;
+    int64 instance_id;
+    uint64 instance_starts;
+    uint32 guest_state;
+    // <prefix>_free, called once the aggregate context is reset, may be NULL
+    WasmFuncInfo *free_func;
+    MemoryContextCallback release;
+    int ncols;
+    int widths[FUNC_MAX_ARGS];
+    int rowwidth;
+    int nrows;
+    int capacity;
+    // capacity rows, column i starting at columns + capacity * offset of i
+    char *columns;
+} WasmAggState;
+
+/*
+ * Per-FmgrInfo state of wasm_invoke_function_N, keyed by the instance id and
+ * function name it was resolved for.
+ */
+typedef struct WasmInvokeCache {
+    WasmSessionState *session;
+    uint64 generation;
+    uint64 registry_generation;
+    char instanceid[MAXINT8LEN + 1];
+    WasmInstInfo *instinfo;
+    WasmFuncInfo *funcinfo;
+} WasmInvokeCache;
+
+static inline WasmSessionContext* wasm_get_session_context()
 {
-    std::map<int64, WasmInstInfo*>::iterator itor = instances.begin();
-    while (itor != instances.end()) {
-        if (itor->first == instanceid) {
-            return itor->second;
-        }
-        itor++;
-    }
-    elog(DEBUG1, "wasm_executor: not find instance info for instanceid %ld", instanceid);
-    return NULL;
+    return (WasmSessionContext*)u_sess->attr.attr_common.extension_session_vars_array[wasm_extension_index];
 }
 
-static std::vector<WasmFuncInfo*>* find_exported_func_list(int64 instanceid)
+void set_extension_index(uint32 index)
 {
-    std::map<int64, std::vector<WasmFuncInfo*>*>::iterator itor = exported_functions.begin();
-    while (itor != exported_functions.end()) {
-        if (itor->first == instanceid) {
-            return itor->second;
-        }
-        itor++;
-    }
-    elog(DEBUG1, "wasm_executor: not find exported func info for instanceid %ld", instanceid);
-    return NULL;
+    wasm_extension_index = index;
+}
+
+void init_session_vars(void)
+{
+    RepallocSessionVarsArrayIfNecessary();
+    WasmSessionContext *context =
+        (WasmSessionContext*)MemoryContextAllocZero(u_sess->self_mem_cxt, sizeof(WasmSessionContext));
+    u_sess->attr.attr_common.extension_session_vars_array[wasm_extension_index] = context;
+
+    DefineCustomEnumVariable("wasm.instance_reset",
+        "Gives each statement or transaction a fresh instance of every module it calls.",
+        NULL, &context->instance_reset, WASM_RESET_NONE, wasm_instance_reset_options,
+        PGC_USERSET, 0, NULL, NULL, NULL);
+    DefineCustomIntVariable("wasm.call_timeout",
+        "Sets the maximum time a single wasm call may run, 0 disables it.",
+        NULL, &context->call_timeout, 0, 0, INT_MAX,
+        PGC_USERSET, GUC_UNIT_MS, NULL, NULL, NULL);
+    DefineCustomBoolVariable("wasm.track_functions",
+        "Collects execution statistics of wasm functions.",
+        NULL, &context->track_functions, true,
+        PGC_SUSET, 0, NULL, NULL, NULL);
+    DefineCustomBoolVariable("wasm.fuel_metering",
+        "Counts the instructions executed by guests, for deterministic limits.",
+        NULL, &context->fuel_metering, false,
+        PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomEnumVariable("wasm.opt_level",
+        "Sets the Cranelift optimization level of compiled modules.",
+        NULL, &context->engine.opt_level, WASMTIME_OPT_LEVEL_SPEED, wasm_opt_level_options,
+        PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomBoolVariable("wasm.parallel_compilation",
+        "Compiles the functions of a module on several threads.",
+        NULL, &context->engine.parallel_compilation, true,
+        PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomBoolVariable("wasm.simd",
+        "Enables the WebAssembly SIMD proposal.",
+        NULL, &context->engine.simd, true,
+        PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomBoolVariable("wasm.bulk_memory",
+        "Enables the WebAssembly bulk memory and reference types proposals.",
+        NULL, &context->engine.bulk_memory, true,
+        PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomIntVariable("wasm.static_memory_maximum_size",
+        "Sets the linear memory size reserved up front, which removes bounds checks from guest code.",
+        NULL, &context->engine.static_memory_maximum_size, 4 * 1024 * 1024, 0, INT_MAX,
+        PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+    DefineCustomIntVariable("wasm.static_memory_guard_size",
+        "Sets the guard region reserved after a static linear memory.",
+        NULL, &context->engine.static_memory_guard_size, 2 * 1024 * 1024, 0, INT_MAX,
+        PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+    DefineCustomIntVariable("wasm.dynamic_memory_guard_size",
+        "Sets the guard region reserved after a dynamic linear memory.",
+        NULL, &context->engine.dynamic_memory_guard_size, 64, 0, INT_MAX,
+        PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+    DefineCustomEnumVariable("wasm.profiler",
+        "Registers compiled guest code with a profiler, so that it shows up with symbols.",
+        NULL, &context->engine.profiler, WASMTIME_PROFILING_STRATEGY_NONE, wasm_profiler_options,
+        PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomIntVariable("wasm.fuel_per_call",
+        "Sets the fuel given to each wasm call when wasm.fuel_metering is on.",
+        NULL, &context->fuel_per_call, 100000000, 1, INT_MAX,
+        PGC_USERSET, 0, NULL, NULL, NULL);
+    DefineCustomIntVariable("wasm.memoize_entries",
+        "Sets the number of results cached per IMMUTABLE wasm function, 0 disables the cache.",
+        NULL, &context->memoize_entries, 0, 0, INT_MAX,
+        PGC_USERSET, 0, NULL, NULL, NULL);
+    DefineCustomIntVariable("wasm.profile_sample_rate",
+        "Times one of every that many calls of wasm functions for wasm_profile_dump, 0 disables sampling.",
+        NULL, &context->profile_sample_rate, 0, 0, INT_MAX,
+        PGC_SUSET, 0, NULL, NULL, NULL);
+    DefineCustomBoolVariable("wasm.tiered_compilation",
+        "Compiles new modules without optimizations first, and swaps in optimized code compiled in the background.",
+        NULL, &context->tiered_compilation, false,
+        PGC_SUSET, 0, NULL, NULL, NULL);
+    DefineCustomIntVariable("wasm.max_memory",
+        "Sets the size a linear memory of an instance may grow to, 0 only applies the module's own limit.",
+        NULL, &context->max_memory, 0, 0, INT_MAX,
+        PGC_SUSET, GUC_UNIT_KB, NULL, NULL, NULL);
+    DefineCustomIntVariable("wasm.max_table_elements",
+        "Sets the number of elements a table of an instance may grow to, 0 only applies the module's own limit.",
+        NULL, &context->max_table_elements, 0, 0, INT_MAX,
+        PGC_SUSET, 0, NULL, NULL, NULL);
+    DefineCustomIntVariable("wasm.session_memory_budget",
+        "Sets the linear memory idle instances of a session may hold before the least recently used are evicted, 0 disables eviction.",
+        NULL, &context->session_memory_budget, 0, 0, INT_MAX,
+        PGC_SUSET, GUC_UNIT_KB, NULL, NULL, NULL);
+    DefineCustomStringVariable("wasm.preload_modules",
+        "Lists module files compiled at server start, when wasm_executor is in shared_preload_libraries.",
+        NULL, &context->preload_modules, "",
+        PGC_POSTMASTER, 0, NULL, NULL, NULL);
 }
 
 static int64 generate_uuid(Datum input) 
@@ -98,13 +666,35 @@ static int64 generate_uuid(Datum input)
     return DatumGetInt64(uuid);
 }
 
+/*
+ * A trap raised to unwind the guest after a host import failed stands for the
+ * ERROR of that import, which is rethrown as is.
+ */
+static void wasm_rethrow_host_error(wasmtime_error_t *error, wasm_trap_t *trap)
+{
+    ErrorData *host_error = (wasm_session != NULL) ? wasm_session->host_error : NULL;
+    if (host_error != NULL) {
+        if (error != NULL) {
+            wasmtime_error_delete(error);
+        }
+        if (trap != NULL) {
+            wasm_trap_delete(trap);
+        }
+        wasm_session->host_error = NULL;
+        ReThrowError(host_error);
+    }
+}
+
 static void exit_with_error(const char *message, wasmtime_error_t *error, wasm_trap_t *trap)
 {
+    wasm_rethrow_host_error(error, trap);
     wasm_byte_vec_t error_message;
     if (error != NULL) {
         wasmtime_error_message(error, &error_message);
+        wasmtime_error_delete(error);
     } else {
         wasm_trap_message(trap, &error_message);
+        wasm_trap_delete(trap);
     }
     char *messaga_info = pstrdup(error_message.data);
     wasm_byte_vec_delete(&error_message);
@@ -112,575 +702,4083 @@ static void exit_with_error(const char *message, wasmtime_error_t *error, wasm_t
     ereport(ERROR, (errmsg("wasm_executor: %s:%s", message, messaga_info)));
 }
 
-static int64 wasm_invoke_function(char *instanceid_str, char* funcname, std::vector<int64> &args)
+static void wasm_epoch_ticker(wasm_engine_t *engine)
 {
-    int64 instanceid = atol(instanceid_str);
-    WasmInstInfo* instanceinfo = find_instance(instanceid);
-    if (instanceinfo == NULL) {
-        ereport(ERROR, (errmsg("wasm_executor: instance with id %ld is not find", instanceid)));
-    }
-    
-    wasmtime_extern_t wasm_extern;
-    wasmtime_context_t* context = wasmtime_store_context(instanceinfo->wasm_store);
-    int funcnamelen = strlen(funcname);
-    bool ok = wasmtime_instance_export_get(context, &instanceinfo->instance, funcname, funcnamelen, &wasm_extern);
-    if (!ok || wasm_extern.kind != WASMTIME_EXTERN_FUNC) {
-        ereport(ERROR, (errmsg("wasm_executor: not find the exported function with name(%s) and namelen(%d)", 
-            funcname, funcnamelen)));
-    }
-
-    wasmtime_func_t wasm_func = wasm_extern.of.func;
-    wasm_functype_t* wasm_functype = wasmtime_func_type(context, &wasm_func);
-    
-    const wasm_valtype_vec_t* wasm_params = wasm_functype_params(wasm_functype);
-    if (wasm_params->size != args.size()) {
-        ereport(ERROR, (errmsg("wasm_executor: function parameters not matched")));
-    }
-
-    wasmtime_val_t call_params[args.size()];
-    for (unsigned int i = 0; i < wasm_params->size; ++i) {
-        if (wasm_valtype_kind(wasm_params->data[i]) == WASM_I32) {
-            call_params[i].kind = WASMTIME_I32;
-            call_params[i].of.i32 = args[i];
-        } else if (wasm_valtype_kind(wasm_params->data[i]) == WASM_I64) {
-            call_params[i].kind = WASMTIME_I64;
-            call_params[i].of.i64 = args[i];
-        } else {
-            ereport(ERROR, (errmsg("wasm_executor: not support the value type(%d) for now", wasm_valtype_kind(wasm_params->data[i]))));
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(WASM_EPOCH_TICK_MS));
+        wasmtime_engine_increment_epoch(engine);
+        wasm_engine_t *baseline = wasm_baseline_engine.load(std::memory_order_acquire);
+        if (baseline != NULL) {
+            wasmtime_engine_increment_epoch(baseline);
         }
+        wasm_epoch_ticks.fetch_add(1, std::memory_order_relaxed);
     }
+}
 
-    wasmtime_val_t results[1];
-    wasm_trap_t *wasm_trap = NULL;
-    wasmtime_error_t *error_msg = wasmtime_func_call(context, &wasm_func, call_params, args.size(), results, 1, &wasm_trap);
-    if (error_msg != NULL || wasm_trap != NULL) {
-        exit_with_error("failed to call function", error_msg, wasm_trap);
+/*
+ * Start a detached helper thread. It runs no openGauss code, and blocks all
+ * signals so that they keep being delivered to the session threads.
+ */
+template <typename Fn>
+static bool wasm_start_thread(Fn fn)
+{
+    sigset_t all_signals;
+    sigset_t old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    bool started = true;
+    try {
+        std::thread(fn).detach();
+    } catch (...) {
+        started = false;
     }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    return started;
+}
 
-    int64 ret_val = 0;
-    if (results[0].kind == WASMTIME_I32) {
-        ret_val = results[0].of.i32;
-    } else if (results[0].kind == WASMTIME_I64) {
-        ret_val = results[0].of.i64;
-    } else {
-        ereport(ERROR, (errmsg("wasm_executor: the function(%s) return type(%d) not supported", funcname, results[0].kind)));
-    }
+/*
+ * Start the epoch ticker. Signals are blocked while the thread is created, so
+ * it inherits a full mask and never receives signals meant for a session.
+ */
+static bool wasm_start_epoch_ticker(wasm_engine_t *engine)
+{
+    return wasm_start_thread([engine]() { wasm_epoch_ticker(engine); });
+}
 
-    return ret_val;
+/*
+ * Read engine settings through the GUC machinery rather than the session
+ * variables: the engine may be created at postmaster start, before any
+ * session exists. Neither may ereport, they run under wasm_engine_lock.
+ */
+static bool wasm_config_bool(const char *name, bool value)
+{
+    const char *setting = GetConfigOption(name, true, false);
+    bool result = value;
+    return (setting != NULL && parse_bool(setting, &result)) ? result : value;
 }
 
-static void wasm_export_funcs_query(int64 instanceid, TupleFuncState* inter_call_data)
+static int wasm_config_int(const char *name, int value, int flags)
 {
-    WasmInstInfo* instanceinfo = find_instance(instanceid);
-    if (instanceinfo == NULL) {
-        ereport(ERROR, (errmsg("wasm_executor: instance with id %ld is not find", instanceid)));
-    }
+    const char *setting = GetConfigOption(name, true, false);
+    int result = value;
+    return (setting != NULL && parse_int(setting, &result, flags, NULL)) ? result : value;
+}
 
-    std::vector<WasmFuncInfo *>* functions = find_exported_func_list(instanceid);
-    if (functions != NULL) {
-        inter_call_data->currindex = functions->begin();
-        inter_call_data->lastindex = functions->end();
-        elog(DEBUG1, "wasm_executor:find exported func info for instanceid %ld", instanceid);
-        return;
+static int wasm_config_enum(const char *name, const struct config_enum_entry *options, int value)
+{
+    const char *setting = GetConfigOption(name, true, false);
+    for (const struct config_enum_entry *option = options; setting != NULL && option->name != NULL; option++) {
+        if (pg_strcasecmp(setting, option->name) == 0) {
+            return option->val;
+        }
     }
+    return value;
+}
 
-    functions = new(std::nothrow)std::vector<WasmFuncInfo *>;
-    exported_functions.insert(std::pair<int64, std::vector<WasmFuncInfo *>*>(instanceid, functions));
-
-    wasmtime_context_t* context = wasmtime_store_context(instanceinfo->wasm_store);
-    wasmtime_instance_t& instance = instanceinfo->instance;
-
-    char *export_name = NULL;
-    size_t namelen;
-    wasmtime_extern_t wasm_extern;
-    int index = 0;
-    while (wasmtime_instance_export_nth(context, &instance, index, &export_name, &namelen, &wasm_extern)) {
-        if (wasm_extern.kind == WASMTIME_EXTERN_FUNC) {
-            wasmtime_func_t wasm_func = wasm_extern.of.func;
-            wasm_functype_t* wasm_functype = wasmtime_func_type(context, &wasm_func);
-            WasmFuncInfo *funcinfo = new(std::nothrow)WasmFuncInfo();
-
-            const wasm_valtype_vec_t* wasm_results = wasm_functype_results(wasm_functype);
-            if (wasm_results->size != 1) {
-                ereport(ERROR, (errmsg("wasm_executor: only support the functions who will return exactly one result value for now")));
-            }
-            //TODO:support more data types
-            if (wasm_valtype_kind(wasm_results->data[0]) == WASM_I32) {
-                funcinfo->outputs = "integer";
-            } else if (wasm_valtype_kind(wasm_results->data[0]) == WASM_I64) {
-                funcinfo->outputs = "bigint";
-            } else {
-                ereport(ERROR, (errmsg("wasm_executor: not support the value type(%d) for now", wasm_valtype_kind(wasm_results->data[0]))));
-            }
+static void wasm_read_engine_settings(WasmEngineSettings *settings)
+{
+    settings->fuel = wasm_config_bool("wasm.fuel_metering", false);
+    settings->opt_level = wasm_config_enum("wasm.opt_level", wasm_opt_level_options, WASMTIME_OPT_LEVEL_SPEED);
+    settings->parallel_compilation = wasm_config_bool("wasm.parallel_compilation", true);
+    settings->simd = wasm_config_bool("wasm.simd", true);
+    settings->bulk_memory = wasm_config_bool("wasm.bulk_memory", true);
+    settings->static_memory_maximum_size =
+        wasm_config_int("wasm.static_memory_maximum_size", 4 * 1024 * 1024, GUC_UNIT_KB);
+    settings->static_memory_guard_size = wasm_config_int("wasm.static_memory_guard_size", 2 * 1024 * 1024, GUC_UNIT_KB);
+    // wasmtime refuses a dynamic guard larger than the static one
+    settings->dynamic_memory_guard_size = Min(wasm_config_int("wasm.dynamic_memory_guard_size", 64, GUC_UNIT_KB),
+        settings->static_memory_guard_size);
+    settings->profiler = wasm_config_enum("wasm.profiler", wasm_profiler_options, WASMTIME_PROFILING_STRATEGY_NONE);
+}
 
-            const wasm_valtype_vec_t* wasm_params = wasm_functype_params(wasm_functype);
-            if (wasm_params->size > 10) {
-                ereport(ERROR, (errmsg("wasm_executor: do not support function with 10 more parameters")));
-            }
+static wasm_engine_t* wasm_create_engine(const WasmEngineSettings &settings)
+{
+    wasm_config_t *config = wasm_config_new();
+    if (config == NULL) {
+        return NULL;
+    }
+    wasmtime_config_epoch_interruption_set(config, true);
+    wasmtime_config_consume_fuel_set(config, settings.fuel);
+    wasmtime_config_cranelift_opt_level_set(config, (wasmtime_opt_level_t)settings.opt_level);
+    wasmtime_config_parallel_compilation_set(config, settings.parallel_compilation);
+    wasmtime_config_profiler_set(config, (wasmtime_profiling_strategy_t)settings.profiler);
+    wasmtime_config_wasm_simd_set(config, settings.simd);
+    // Reference types depend on bulk memory
+    wasmtime_config_wasm_bulk_memory_set(config, settings.bulk_memory);
+    wasmtime_config_wasm_reference_types_set(config, settings.bulk_memory);
+    wasmtime_config_static_memory_maximum_size_set(config, (uint64)settings.static_memory_maximum_size * 1024);
+    wasmtime_config_static_memory_guard_size_set(config, (uint64)settings.static_memory_guard_size * 1024);
+    wasmtime_config_dynamic_memory_guard_size_set(config, (uint64)settings.dynamic_memory_guard_size * 1024);
+    return wasm_engine_new_with_config(config);
+}
 
-            for (unsigned int i = 0; i < wasm_params->size; ++i) {
-                if (wasm_valtype_kind(wasm_params->data[i]) == WASM_I32) {
-                    funcinfo->inputs += "integer,";
-                } else if (wasm_valtype_kind(wasm_params->data[i]) == WASM_I64) {
-                    funcinfo->inputs += "bigint,";
-                } else {
-                    ereport(ERROR, (errmsg("wasm_executor: not support the value type(%d) for now", wasm_valtype_kind(wasm_params->data[i]))));
-                }
-            }
-            if (funcinfo->inputs.length() > 0) {
-                funcinfo->inputs.pop_back();
+/*
+ * Return the process-wide engine. All modules are compiled against it, so
+ * compiled code can be shared by every instance and every session.
+ */
+static wasm_engine_t* wasm_get_engine()
+{
+    wasm_engine_t *engine = NULL;
+    {
+        // No ereport while holding the lock, it would never be released
+        std::lock_guard<std::mutex> guard(wasm_engine_lock);
+        if (wasm_engine == NULL) {
+            WasmEngineSettings settings;
+            wasm_read_engine_settings(&settings);
+            engine = wasm_create_engine(settings);
+            if (engine != NULL && !wasm_start_epoch_ticker(engine)) {
+                wasm_engine_delete(engine);
+                engine = NULL;
             }
-
-            funcinfo->funcname = std::string(export_name, namelen);
-            functions->push_back(funcinfo);
+            wasm_engine = engine;
+            wasm_engine_settings = settings;
         }
-        index++;
+        engine = wasm_engine;
     }
-    
-    inter_call_data->currindex = functions->begin();
-    inter_call_data->lastindex = functions->end();
-    elog(DEBUG1, "wasm_executor:init exported func info for instanceid %ld", instanceid);
+    if (engine == NULL) {
+        ereport(ERROR, (errmsg("wasm_executor: unable to create new wasm engine")));
+    }
+    return engine;
 }
 
-PG_FUNCTION_INFO_V1(wasm_create_instance_wat);
-Datum wasm_create_instance_wat(PG_FUNCTION_ARGS) 
+/*
+ * Engine of the first tier of tiered compilation: the same settings, but
+ * Cranelift optimizations off. Its epoch is advanced by the same ticker.
+ */
+static wasm_engine_t* wasm_get_baseline_engine()
 {
-    int64 uuid = generate_uuid(PG_GETARG_DATUM(0));
-    text *arg = PG_GETARG_TEXT_P(0);
-    char* filepath = text_to_cstring(arg);
-    canonicalize_path(filepath);
-    
-    if (!superuser())
-        ereport(ERROR,
-            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE), (errmsg("wasm_executor: must be system admin to create wasm instance"))));
-
-    WasmInstInfo *instinfo = find_instance(uuid);
-    if (instinfo != NULL) {
-        ereport(NOTICE, (errmsg("wasm_executor: instance already created for %s", filepath)));
-        return UInt32GetDatum(uuid);
+    (void)wasm_get_engine();
+    wasm_engine_t *engine = NULL;
+    {
+        std::lock_guard<std::mutex> guard(wasm_engine_lock);
+        engine = wasm_baseline_engine.load(std::memory_order_relaxed);
+        if (engine == NULL) {
+            WasmEngineSettings settings = wasm_engine_settings;
+            settings.opt_level = WASMTIME_OPT_LEVEL_NONE;
+            engine = wasm_create_engine(settings);
+            wasm_baseline_engine.store(engine, std::memory_order_release);
+        }
     }
-
-    instinfo = new (std::nothrow)WasmInstInfo();
-    
-    instinfo->wasm_engine = wasm_engine_new();
-    if (instinfo->wasm_engine == NULL) {
+    if (engine == NULL) {
         ereport(ERROR, (errmsg("wasm_executor: unable to create new wasm engine")));
     }
-    instinfo->wasm_store = wasmtime_store_new(instinfo->wasm_engine, NULL, NULL);
-    if (instinfo->wasm_store == NULL) {
-        ereport(ERROR, (errmsg("wasm_executor: unable to create new wasmtime storage")));
+    return engine;
+}
+
+static std::shared_ptr<WasmModuleInfo> wasm_find_module(int64 instanceid)
+{
+    std::shared_ptr<const WasmModuleMap> modules = std::atomic_load(&wasm_modules);
+    WasmModuleMap::const_iterator itor = modules->find(instanceid);
+    if (itor != modules->end()) {
+        return itor->second;
     }
-    wasmtime_context_t *context = wasmtime_store_context(instinfo->wasm_store);
-    
-    wasm_byte_vec_t wat_bytes;
-    FILE *file = fopen(filepath, "r");
-    if (file == NULL) {
-        ereport(ERROR, (errmsg("wasm_executor: unable to open file %s", filepath)));
+    elog(DEBUG1, "wasm_executor: not find module info for instanceid %ld", instanceid);
+    return std::shared_ptr<WasmModuleInfo>();
+}
+
+/*
+ * Publish a module. If another session registered the same id meanwhile, that
+ * module wins and is returned instead.
+ */
+static std::shared_ptr<WasmModuleInfo> wasm_publish_module(const std::shared_ptr<WasmModuleInfo> &module)
+{
+    std::lock_guard<std::mutex> guard(wasm_modules_lock);
+    std::shared_ptr<const WasmModuleMap> modules = std::atomic_load(&wasm_modules);
+    WasmModuleMap::const_iterator itor = modules->find(module->id);
+    if (itor != modules->end()) {
+        return itor->second;
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t file_size = ftell(file);
-    wasm_byte_vec_new_uninitialized(&wat_bytes, file_size);
-    fseek(file, 0L, SEEK_SET);
-    int ret = fread(wat_bytes.data, file_size, 1, file);
-    fclose(file);
-    if (ret != 1) {
-        ereport(ERROR, (errmsg("wasm_executor: failed to load moude from %s", filepath)));
+    std::shared_ptr<WasmModuleMap> newmodules = std::make_shared<WasmModuleMap>(*modules);
+    (*newmodules)[module->id] = module;
+    std::atomic_store(&wasm_modules, std::shared_ptr<const WasmModuleMap>(newmodules));
+    wasm_registry_generation.fetch_add(1);
+    return module;
+}
+
+/*
+ * Swap in a new version of a module. Calls already running finish on their
+ * instance of the old version, and every thread moves to the new one on its
+ * next lookup, see wasm_session_sync. The old code is freed along with its
+ * last instance. Called at commit, so it must not ereport.
+ */
+static void wasm_replace_module(const std::shared_ptr<WasmModuleInfo> &module)
+{
+    std::lock_guard<std::mutex> guard(wasm_modules_lock);
+    std::shared_ptr<const WasmModuleMap> modules = std::atomic_load(&wasm_modules);
+    WasmModuleMap::const_iterator itor = modules->find(module->id);
+    if (itor != modules->end() && itor->second->version >= module->version) {
+        return;
     }
 
-    wasm_byte_vec_t wasm_bytes;
-    wasmtime_error_t *error_msg = wasmtime_wat2wasm(wat_bytes.data, wat_bytes.size, &wasm_bytes);
-    if (error_msg != NULL) {
-        exit_with_error("failed to parse wat", error_msg, NULL);
-    }      
-    wasm_byte_vec_delete(&wat_bytes);
+    std::shared_ptr<WasmModuleMap> newmodules = std::make_shared<WasmModuleMap>(*modules);
+    (*newmodules)[module->id] = module;
+    std::atomic_store(&wasm_modules, std::shared_ptr<const WasmModuleMap>(newmodules));
+    wasm_registry_generation.fetch_add(1);
+}
 
-    error_msg = wasmtime_module_new(instinfo->wasm_engine, (uint8 *)wasm_bytes.data, wasm_bytes.size, &instinfo->wasm_module);
-    if (instinfo->wasm_module == NULL) {
-        exit_with_error("failed to compile module", error_msg, NULL);
+/*
+ * Remove a module from the registry. Instances still referencing it keep the
+ * compiled code alive until their threads notice the new generation.
+ */
+static std::shared_ptr<WasmModuleInfo> wasm_unpublish_module(int64 instanceid)
+{
+    std::lock_guard<std::mutex> guard(wasm_modules_lock);
+    std::shared_ptr<const WasmModuleMap> modules = std::atomic_load(&wasm_modules);
+    WasmModuleMap::const_iterator itor = modules->find(instanceid);
+    if (itor == modules->end()) {
+        return std::shared_ptr<WasmModuleInfo>();
     }
-    wasm_byte_vec_delete(&wasm_bytes);
 
-    wasm_trap_t *wasm_trap = NULL;
-    error_msg = wasmtime_instance_new(context, instinfo->wasm_module, NULL, 0, &instinfo->instance, &wasm_trap);
-    if (error_msg != NULL || wasm_trap != NULL) {
-        exit_with_error("failed to create wasm instance", error_msg, wasm_trap);
+    std::shared_ptr<WasmModuleInfo> module = itor->second;
+    std::shared_ptr<WasmModuleMap> newmodules = std::make_shared<WasmModuleMap>(*modules);
+    newmodules->erase(instanceid);
+    std::atomic_store(&wasm_modules, std::shared_ptr<const WasmModuleMap>(newmodules));
+    wasm_registry_generation.fetch_add(1);
+    return module;
+}
+
+static void wasm_instance_stop(WasmInstInfo *instinfo)
+{
+    if (instinfo->wasm_store != NULL) {
+        wasmtime_store_delete(instinfo->wasm_store);
+        instinfo->wasm_store = NULL;
+        instinfo->wasm_context = NULL;
+    }
+    instinfo->scratch_ptr = 0;
+    instinfo->scratch_size = 0;
+    instinfo->pending_frees.clear();
+    if (instinfo->stat_slot) {
+        instinfo->stat_slot->running.store(false, std::memory_order_relaxed);
+        instinfo->stat_slot->memory_bytes.store(0, std::memory_order_relaxed);
     }
+}
 
-    instinfo->wasm_file = filepath;
-    instances.insert(std::pair<int64, WasmInstInfo*>(uuid, instinfo));
+static void wasm_instance_destroy(WasmInstInfo *instinfo)
+{
+    wasm_instance_stop(instinfo);
+    if (instinfo->stat_slot) {
+        std::lock_guard<std::mutex> guard(wasm_stat_lock);
+        std::vector<std::shared_ptr<WasmStatSlot>>::iterator itor =
+            std::find(wasm_stat_slots.begin(), wasm_stat_slots.end(), instinfo->stat_slot);
+        if (itor != wasm_stat_slots.end()) {
+            wasm_stat_slots.erase(itor);
+        }
+    }
+    delete instinfo;
+}
 
-    return Int64GetDatum(uuid);
+static inline uint64 wasm_clock_ns()
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-PG_FUNCTION_INFO_V1(wasm_create_instance);
-Datum wasm_create_instance(PG_FUNCTION_ARGS) 
+static inline void wasm_stat_add(std::atomic<uint64> &counter, uint64 value)
 {
-    int64 uuid = generate_uuid(PG_GETARG_DATUM(0));
-    text *arg = PG_GETARG_TEXT_P(0);
-    char* filepath = text_to_cstring(arg);
-    canonicalize_path(filepath);
-    
-    if (!superuser())
-        ereport(ERROR,
-            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE), (errmsg("wasm_executor: must be system admin to create wasm instance"))));
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
 
-    WasmInstInfo *instinfo = find_instance(uuid);
-    if (instinfo != NULL) {
-        ereport(NOTICE, (errmsg("wasm_executor: instance already created for %s", filepath)));
-        return UInt32GetDatum(uuid);
+static void wasm_stat_register(WasmInstInfo *instinfo)
+{
+    std::shared_ptr<WasmStatSlot> slot = std::make_shared<WasmStatSlot>();
+    size_t nfuncs = instinfo->module->functions.size();
+    slot->module = instinfo->module;
+    slot->funcs.reset(new WasmFuncStats[nfuncs]());
+    {
+        std::lock_guard<std::mutex> guard(wasm_stat_lock);
+        wasm_stat_slots.push_back(slot);
     }
+    instinfo->stat_slot = slot;
+    instinfo->stats = slot->funcs.get();
+}
 
-    instinfo = new (std::nothrow)WasmInstInfo();
-    
-    instinfo->wasm_engine = wasm_engine_new();
-    if (instinfo->wasm_engine == NULL) {
-        ereport(ERROR, (errmsg("wasm_executor: unable to create new wasm engine")));
+static inline void wasm_stat_bytes(WasmInstInfo *instinfo, WasmFuncInfo *funcinfo, uint64 bytes_in, uint64 bytes_out)
+{
+    WasmFuncStats *stats = &instinfo->stats[funcinfo->index];
+    wasm_stat_add(stats->bytes_in, bytes_in);
+    wasm_stat_add(stats->bytes_out, bytes_out);
+}
+
+static void wasm_session_evict(WasmSessionState *session, WasmInstInfo *keep);
+
+static void wasm_session_xact_callback(XactEvent event, void *arg)
+{
+    if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT) {
+        return;
     }
-    instinfo->wasm_store = wasmtime_store_new(instinfo->wasm_engine, NULL, NULL);
-    if (instinfo->wasm_store == NULL) {
-        ereport(ERROR, (errmsg("wasm_executor: unable to create new wasmtime storage")));
+    // Module versions reloaded by the transaction go live once it committed
+    if (wasm_pending_count.load(std::memory_order_relaxed) > 0) {
+        std::vector<std::shared_ptr<WasmModuleInfo>> reloads;
+        {
+            std::lock_guard<std::mutex> guard(wasm_pending_lock);
+            auto itor = wasm_pending_reloads.find(u_sess->session_id);
+            if (itor != wasm_pending_reloads.end()) {
+                reloads.swap(itor->second);
+                wasm_pending_reloads.erase(itor);
+                wasm_pending_count.fetch_sub(1);
+            }
+        }
+        for (const std::shared_ptr<WasmModuleInfo> &module : reloads) {
+            if (event == XACT_EVENT_COMMIT) {
+                wasm_replace_module(module);
+            }
+        }
     }
-    wasmtime_context_t *context = wasmtime_store_context(instinfo->wasm_store);
-    
-    wasm_byte_vec_t wasm_bytes;
-    FILE *file = fopen(filepath, "rb");
-    if (file == NULL) {
-        ereport(ERROR, (errmsg("wasm_executor: unable to open file %s", filepath)));
+    // The session may have moved to another thread since it registered
+    if (wasm_session == NULL) {
+        return;
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t file_size = ftell(file);
-    wasm_byte_vec_new_uninitialized(&wasm_bytes, file_size);
-    fseek(file, 0L, SEEK_SET);
-    int ret = fread(wasm_bytes.data, file_size, 1, file);
-    fclose(file);
-    if (ret != 1) {
-        ereport(ERROR, (errmsg("wasm_executor: failed to load moude from %s", filepath)));
+    // Portals do not outlive the transaction
+    wasm_session->cursors.clear();
+    wasm_session->host_error = NULL;
+    if (wasm_get_session_context()->instance_reset == WASM_RESET_TRANSACTION) {
+        wasm_session->reset_epoch++;
     }
-
-    wasmtime_error_t *error_msg = wasmtime_module_new(instinfo->wasm_engine, (uint8 *)wasm_bytes.data, wasm_bytes.size, &instinfo->wasm_module);
-    if (instinfo->wasm_module == NULL) {
-        exit_with_error("failed to compile module", error_msg, NULL);
+    // Every instance is idle between transactions
+    wasm_session->xact_clock = wasm_session->checkout_clock;
+    if (!wasm_session->instances.empty()) {
+        wasm_session_evict(wasm_session, NULL);
     }
-    wasm_byte_vec_delete(&wasm_bytes);
+}
 
-    wasm_trap_t *wasm_trap = NULL;
-    error_msg = wasmtime_instance_new(context, instinfo->wasm_module, NULL, 0, &instinfo->instance, &wasm_trap);
-    if (error_msg != NULL || wasm_trap != NULL) {
-        exit_with_error("failed to create wasm instance", error_msg, wasm_trap);
+/*
+ * Destroy the instances of a thread when it exits. Stream threads of parallel
+ * queries instantiate the modules they call on their own, and come and go
+ * with the thread pool.
+ */
+static void wasm_session_destroy(void *arg)
+{
+    WasmSessionState *session = (WasmSessionState*)arg;
+    for (auto &entry : session->instances) {
+        wasm_instance_destroy(entry.second);
+    }
+    for (auto &entry : session->memos) {
+        delete entry.second;
     }
+    delete session;
+}
 
-    instinfo->wasm_file = filepath;
-    instances.insert(std::pair<int64, WasmInstInfo*>(uuid, instinfo));
+static void wasm_session_key_init()
+{
+    (void)pthread_key_create(&wasm_session_key, wasm_session_destroy);
+}
 
-    return Int64GetDatum(uuid);
+static WasmSessionState* wasm_get_session()
+{
+    if (wasm_session == NULL) {
+        wasm_session = new WasmSessionState();
+        wasm_session->generation = 1;
+        wasm_session->registry_generation = wasm_registry_generation.load();
+        wasm_session->reset_epoch = 1;
+        wasm_session->statement_start = 0;
+        wasm_session->deadline_statement = 0;
+        wasm_session->deadline_timeout = 0;
+        wasm_session->statement_deadline = WASM_NO_DEADLINE;
+        wasm_session->call_deadline = false;
+        wasm_session->stat_child_ns = 0;
+        wasm_session->last_call_ns = 0;
+        wasm_session->profile_call = false;
+        wasm_session->profile_countdown = 0;
+        wasm_session->emit_cache = NULL;
+        wasm_session->emit_store = NULL;
+        wasm_session->host_error = NULL;
+        wasm_session->host_depth = 0;
+        wasm_session->session_id = 0;
+        wasm_session->checkout_clock = 0;
+        wasm_session->xact_clock = 0;
+        wasm_session->armed_deadline = WASM_NO_DEADLINE;
+        wasm_session->epoch_stopped = false;
+        (void)pthread_once(&wasm_session_key_once, wasm_session_key_init);
+        (void)pthread_setspecific(wasm_session_key, wasm_session);
+    }
+
+    /*
+     * A thread serves many sessions over its life, e.g. a stream worker runs
+     * its part of a parallel query in a session of its own. Each of them may
+     * lack the variables of the extension, and needs the transaction hook.
+     */
+    if (wasm_session->session_id != u_sess->session_id) {
+        RepallocSessionVarsArrayIfNecessary();
+        if (u_sess->attr.attr_common.extension_session_vars_array[wasm_extension_index] == NULL) {
+            init_session_vars();
+        }
+        UnregisterXactCallback(wasm_session_xact_callback, NULL);
+        RegisterXactCallback(wasm_session_xact_callback, NULL);
+        wasm_session->session_id = u_sess->session_id;
+        // Function oids are only meaningful within the session's database
+        for (auto &entry : wasm_session->memos) {
+            delete entry.second;
+        }
+        wasm_session->memos.clear();
+        wasm_session->cursors.clear();
+        wasm_session->generation++;
+    }
+    return wasm_session;
 }
 
-PG_FUNCTION_INFO_V1(wasm_drop_instance);
-Datum wasm_drop_instance(PG_FUNCTION_ARGS) 
+/*
+ * Catch up with the registry: instances whose module was dropped or replaced
+ * are destroyed, and the next lookup instantiates the current module again.
+ */
+static void wasm_session_sync(WasmSessionState *session)
 {
-    int64 instanceid = PG_GETARG_INT64(0);
-    Datum module_path;
-    
-    if (!superuser())
-        ereport(ERROR,
-            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE), (errmsg("wasm_executor: must be system admin to delete wasm instance"))));
+    uint64 registry_generation = wasm_registry_generation.load();
+    // Nested in a host import, an instance may be destroyed under its caller
+    if (session->registry_generation == registry_generation || session->host_depth > 0) {
+        return;
+    }
 
-    std::map<int64, WasmInstInfo*>::iterator institor = instances.begin();
-    while (institor != instances.end() && institor->first != instanceid) {
-        institor++;
+    std::shared_ptr<const WasmModuleMap> modules = std::atomic_load(&wasm_modules);
+    std::unordered_map<int64, WasmInstInfo*>::iterator itor = session->instances.begin();
+    while (itor != session->instances.end()) {
+        WasmModuleMap::const_iterator moditor = modules->find(itor->first);
+        if (moditor == modules->end() || moditor->second != itor->second->module) {
+            wasm_instance_destroy(itor->second);
+            itor = session->instances.erase(itor);
+            session->generation++;
+        } else {
+            itor++;
+        }
     }
-    if (institor == instances.end()) {
-        ereport(ERROR, (errmsg("wasm_executor:instance with id=%ld not exist", instanceid)));
+    session->registry_generation = registry_generation;
+}
+
+/*
+ * Epoch tick at which the next call must stop, from statement_timeout and
+ * wasm.call_timeout. The statement part is only computed once per statement.
+ */
+static uint64 wasm_call_deadline(WasmSessionState *session, uint64 now)
+{
+    int statement_timeout = u_sess->attr.attr_common.StatementTimeout;
+    TimestampTz statement_start = GetCurrentStatementStartTimestamp();
+    if (session->deadline_statement != statement_start || session->deadline_timeout != statement_timeout) {
+        session->deadline_statement = statement_start;
+        session->deadline_timeout = statement_timeout;
+        session->statement_deadline = WASM_NO_DEADLINE;
+        if (statement_timeout > 0) {
+            int64 elapsed_ms = (GetCurrentTimestamp() - statement_start) / 1000;
+            int64 remaining_ms = Max((int64)statement_timeout - elapsed_ms, 0);
+            session->statement_deadline = now + (remaining_ms + WASM_EPOCH_TICK_MS - 1) / WASM_EPOCH_TICK_MS;
+        }
     }
-    module_path = CStringGetTextDatum(institor->second->wasm_file.c_str());
-    instances.erase(institor);
 
-    std::map<int64, std::vector<WasmFuncInfo*>*>::iterator funcitor = exported_functions.begin();
-    while (funcitor != exported_functions.end() && funcitor->first == instanceid) {
-        exported_functions.erase(funcitor++);
+    uint64 deadline = session->statement_deadline;
+    int call_timeout = wasm_get_session_context()->call_timeout;
+    session->call_deadline = false;
+    if (call_timeout > 0) {
+        uint64 call_deadline = now + ((uint64)call_timeout + WASM_EPOCH_TICK_MS - 1) / WASM_EPOCH_TICK_MS;
+        if (call_deadline < deadline) {
+            deadline = call_deadline;
+            session->call_deadline = true;
+        }
     }
-    
-    return module_path;
+    return deadline;
 }
 
-PG_FUNCTION_INFO_V1(wasm_get_instances);
-Datum wasm_get_instances(PG_FUNCTION_ARGS) 
+/*
+ * Arm the store of instinfo before entering the guest: give it a slice of one
+ * epoch tick, renewed by wasm_epoch_callback until the deadline passes, and,
+ * in fuel metering mode, refill its fuel to exactly wasm.fuel_per_call.
+ */
+static inline void wasm_prepare_call(WasmInstInfo *instinfo)
 {
-    FuncCallContext* fctx = NULL;
-    TupleInstanceState* inter_call_data = NULL;
-    if (SRF_IS_FIRSTCALL()) {
-        TupleDesc tupdesc;
-        MemoryContext mctx;
+    uint64 now = wasm_epoch_ticks.load(std::memory_order_relaxed);
+    WasmSessionState *session = wasm_get_session();
+    uint64 deadline = wasm_call_deadline(session, now);
+    session->armed_deadline = deadline;
+    session->epoch_stopped = false;
+    wasmtime_context_set_epoch_deadline(instinfo->wasm_context, (deadline > now) ? 1 : 0);
 
-        fctx = SRF_FIRSTCALL_INIT();
+    if (unlikely(wasm_engine_settings.fuel)) {
+        uint64 fuel = (uint64)wasm_get_session_context()->fuel_per_call;
+        uint64 remaining = 0;
+        wasmtime_error_t *error_msg = wasmtime_context_consume_fuel(instinfo->wasm_context, 0, &remaining);
+        if (error_msg == NULL && remaining < fuel) {
+            error_msg = wasmtime_context_add_fuel(instinfo->wasm_context, fuel - remaining);
+        } else if (error_msg == NULL && remaining > fuel) {
+            error_msg = wasmtime_context_consume_fuel(instinfo->wasm_context, remaining - fuel, &remaining);
+        }
+        if (error_msg != NULL) {
+            exit_with_error("failed to set fuel", error_msg, NULL);
+        }
+    }
+}
+
+/*
+ * Runs on the thread of the call whenever its slice ends, so the interrupt
+ * flags it reads are its own. The call goes on for another tick, unless a
+ * cancel request is pending or the deadline has passed; the call then fails
+ * and wasm_report_stop raises the matching ERROR once the guest has unwound.
+ */
+static wasmtime_error_t* wasm_epoch_callback(wasmtime_context_t *context, void *data,
+    uint64_t *epoch_deadline_delta, wasmtime_update_deadline_kind_t *update_kind)
+{
+    WasmSessionState *session = wasm_session;
+    bool interrupt = t_thrd.int_cxt.InterruptPending && t_thrd.int_cxt.InterruptHoldoffCount == 0 &&
+        t_thrd.int_cxt.CritSectionCount == 0;
+    if (!interrupt && wasm_epoch_ticks.load(std::memory_order_relaxed) < session->armed_deadline) {
+        *epoch_deadline_delta = 1;
+        *update_kind = WASMTIME_UPDATE_DEADLINE_CONTINUE;
+        return NULL;
+    }
+    session->epoch_stopped = true;
+    return wasmtime_error_new("call stopped at its epoch deadline");
+}
+
+/*
+ * Raise the ERROR of a call wasm_epoch_callback stopped, if any: the pending
+ * cancel request through CHECK_FOR_INTERRUPTS, or the deadline reported the
+ * same way as a statement_timeout hit outside of wasm.
+ */
+static void wasm_report_stop(wasmtime_error_t *error, wasm_trap_t *wasm_trap)
+{
+    if (!wasm_session->epoch_stopped) {
+        return;
+    }
+    wasm_session->epoch_stopped = false;
+    if (error != NULL) {
+        wasmtime_error_delete(error);
+    }
+    if (wasm_trap != NULL) {
+        wasm_trap_delete(wasm_trap);
+    }
+    CHECK_FOR_INTERRUPTS();
+    bool expired = wasm_epoch_ticks.load(std::memory_order_relaxed) >= wasm_session->armed_deadline;
+    if (expired && wasm_session->call_deadline) {
+        ereport(ERROR, (errcode(ERRCODE_QUERY_CANCELED),
+            errmsg("wasm_executor: canceling call due to wasm.call_timeout")));
+    }
+    if (expired) {
+        ereport(ERROR, (errcode(ERRCODE_QUERY_CANCELED), errmsg("canceling statement due to statement timeout")));
+    }
+    // The guest has unwound already, even if ProcessInterrupts chose to ignore the request
+    ereport(ERROR, (errcode(ERRCODE_QUERY_CANCELED), errmsg("canceling statement due to user request")));
+}
+
+/*
+ * Turn a failed call into an ERROR. wasmtime returns errors raised outside of
+ * guest code, e.g. by host imports or wasm_epoch_callback, apart from traps.
+ */
+static void wasm_report_trap(WasmInstInfo *instinfo, wasmtime_error_t *error, wasm_trap_t *wasm_trap)
+{
+    wasm_rethrow_host_error(error, wasm_trap);
+    wasm_report_stop(error, wasm_trap);
+    if (error != NULL) {
+        exit_with_error("failed to call function", error, NULL);
+    }
+
+    uint64 remaining = 0;
+    if (wasm_engine_settings.fuel && wasmtime_context_consume_fuel(instinfo->wasm_context, 0, &remaining) == NULL &&
+        remaining == 0) {
+        wasm_trap_delete(wasm_trap);
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+            errmsg("wasm_executor: call ran out of fuel"),
+            errhint("Raise wasm.fuel_per_call to allow longer calls.")));
+    }
+    exit_with_error("failed to call function", NULL, wasm_trap);
+}
+
+static wasmtime_linker_t* wasm_get_linker(wasm_engine_t *engine);
+
+/*
+ * Bytes of linear memory held by a running instance. Only the exported memory
+ * is seen, which is the one memory of modules built by the usual toolchains.
+ */
+static uint64 wasm_instance_memory(WasmInstInfo *instinfo)
+{
+    if (instinfo->wasm_store == NULL || !instinfo->has_memory) {
+        return 0;
+    }
+    return wasmtime_memory_data_size(instinfo->wasm_context, &instinfo->memory);
+}
+
+/*
+ * Measure the linear memory of the thread's instances for wasm.stat_modules,
+ * and stop the least recently used idle ones until the total fits in
+ * wasm.session_memory_budget. An instance is idle when it was not called in the
+ * current transaction, so aggregates and cursors keep their guest state. An
+ * evicted instance keeps its WasmInstInfo and is started again from the
+ * compiled module on its next call, with fresh guest state like a reset.
+ */
+static void wasm_session_evict(WasmSessionState *session, WasmInstInfo *keep)
+{
+    std::vector<WasmInstInfo*> idle;
+    uint64 total = 0;
+    for (auto &entry : session->instances) {
+        WasmInstInfo *instinfo = entry.second;
+        if (instinfo->wasm_store == NULL) {
+            continue;
+        }
+        uint64 bytes = wasm_instance_memory(instinfo);
+        instinfo->stat_slot->memory_bytes.store(bytes, std::memory_order_relaxed);
+        total += bytes;
+        if (instinfo != keep && instinfo->last_checkout <= session->xact_clock) {
+            idle.push_back(instinfo);
+        }
+    }
+
+    uint64 budget = (uint64)wasm_get_session_context()->session_memory_budget * 1024;
+    // Nested in a host import, the callers' instances are not idle
+    if (budget == 0 || total <= budget || session->host_depth > 0) {
+        return;
+    }
+    std::sort(idle.begin(), idle.end(), [](const WasmInstInfo *a, const WasmInstInfo *b) {
+        return a->last_checkout < b->last_checkout;
+    });
+    for (WasmInstInfo *instinfo : idle) {
+        if (total <= budget) {
+            break;
+        }
+        total -= instinfo->stat_slot->memory_bytes.load(std::memory_order_relaxed);
+        wasm_instance_stop(instinfo);
+        instinfo->module->evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/*
+ * Create the store and instance of instinfo. A new instance maps the memory
+ * image of the module copy-on-write, so this is also how an instance is reset:
+ * the old store is dropped with all guest state and a new one takes its place.
+ * On failure the instance is left stopped and the next checkout retries.
+ */
+static void wasm_instance_start(WasmInstInfo *instinfo)
+{
+    WasmModuleInfo *module = instinfo->module.get();
+    wasm_instance_stop(instinfo);
+    // Once the optimized code is ready, it replaces baseline code on restart
+    instinfo->baseline = module->tier_up.load(std::memory_order_acquire) != WASM_TIER_UP_DONE &&
+        module->engine != wasm_get_engine();
+    wasmtime_module_t *code = instinfo->baseline ? module->wasm_module :
+        (module->optimized_module != NULL ? module->optimized_module : module->wasm_module);
+    wasm_engine_t *engine = instinfo->baseline ? module->engine : wasm_get_engine();
+    wasmtime_linker_t *linker = wasm_get_linker(engine);
+    // Host imports find their instance through the store data
+    instinfo->wasm_store = wasmtime_store_new(engine, instinfo, NULL);
+    if (instinfo->wasm_store == NULL) {
+        ereport(ERROR, (errmsg("wasm_executor: unable to create new wasmtime storage")));
+    }
+    instinfo->wasm_context = wasmtime_store_context(instinfo->wasm_store);
+    // Growing past a limit fails in the guest, as memory.grow and table.grow return -1
+    WasmSessionContext *context = wasm_get_session_context();
+    wasmtime_store_limiter(instinfo->wasm_store,
+        (context->max_memory > 0) ? (int64)context->max_memory * 1024 : -1,
+        (context->max_table_elements > 0) ? context->max_table_elements : -1, -1, -1, -1);
+    wasmtime_store_epoch_deadline_callback(instinfo->wasm_store, wasm_epoch_callback, NULL, NULL);
+
+    uint64 start_ns = wasm_clock_ns();
+    // The start function, if any, runs under the same limits as a call
+    wasm_prepare_call(instinfo);
+    wasm_trap_t *wasm_trap = NULL;
+    wasmtime_error_t *error_msg = wasmtime_linker_instantiate(linker, instinfo->wasm_context, code,
+        &instinfo->instance, &wasm_trap);
+    if (error_msg != NULL || wasm_trap != NULL) {
+        wasm_instance_stop(instinfo);
+        wasm_report_stop(error_msg, wasm_trap);
+        exit_with_error("failed to create wasm instance", error_msg, wasm_trap);
+    }
+
+    instinfo->funcs.resize(module->functions.size());
+    for (WasmFuncInfo *funcinfo : module->functions) {
+        wasmtime_extern_t wasm_extern;
+        bool ok = wasmtime_instance_export_get(instinfo->wasm_context, &instinfo->instance,
+            funcinfo->funcname.c_str(), funcinfo->funcname.length(), &wasm_extern);
+        if (!ok || wasm_extern.kind != WASMTIME_EXTERN_FUNC) {
+            wasm_instance_stop(instinfo);
+            ereport(ERROR, (errmsg("wasm_executor: not find the exported function with name(%s)",
+                funcinfo->funcname.c_str())));
+        }
+        instinfo->funcs[funcinfo->index] = wasm_extern.of.func;
+    }
+
+    wasmtime_extern_t wasm_extern;
+    instinfo->has_memory = wasmtime_instance_export_get(instinfo->wasm_context, &instinfo->instance,
+        WASM_MEMORY_EXPORT, strlen(WASM_MEMORY_EXPORT), &wasm_extern) && wasm_extern.kind == WASMTIME_EXTERN_MEMORY;
+    if (instinfo->has_memory) {
+        instinfo->memory = wasm_extern.of.memory;
+    }
+    instinfo->used = false;
+    instinfo->starts++;
+
+    module->instantiations.fetch_add(1, std::memory_order_relaxed);
+    module->instantiate_ns.fetch_add(wasm_clock_ns() - start_ns, std::memory_order_relaxed);
+    instinfo->stat_slot->running.store(true, std::memory_order_relaxed);
+    wasm_session_evict(wasm_session, instinfo);
+}
+
+static void wasm_session_check_statement(WasmSessionState *session)
+{
+    TimestampTz statement_start = GetCurrentStatementStartTimestamp();
+    if (statement_start != session->statement_start) {
+        session->statement_start = statement_start;
+        session->reset_epoch++;
+    }
+}
+
+static inline void wasm_call_raw(WasmInstInfo *instinfo, WasmFuncInfo *funcinfo, wasmtime_val_raw_t *args_and_results);
+
+/*
+ * Hand the aggregate states queued by wasm_agg_release_state to their _free
+ * export. The queue is taken first, so a failing call does not free twice.
+ */
+static void wasm_instance_release_states(WasmInstInfo *instinfo)
+{
+    std::vector<std::pair<WasmFuncInfo*, uint32>> frees;
+    frees.swap(instinfo->pending_frees);
+    for (std::pair<WasmFuncInfo*, uint32> &entry : frees) {
+        wasmtime_val_raw_t args_and_results[1];
+        args_and_results[0].i32 = (int32)entry.second;
+        wasm_call_raw(instinfo, entry.first, args_and_results);
+    }
+}
+
+/*
+ * Make instinfo ready for a call. With wasm.instance_reset set, an instance
+ * used in an earlier statement or transaction is restarted first, so every
+ * statement or transaction sees fresh guest state. The WasmInstInfo itself is
+ * kept, so pointers cached in fn_extra stay valid across resets.
+ */
+static inline void wasm_instance_checkout(WasmInstInfo *instinfo)
+{
+    WasmSessionState *session = wasm_session;
+    if (unlikely(wasm_get_session_context()->instance_reset == WASM_RESET_STATEMENT)) {
+        wasm_session_check_statement(session);
+    }
+    if (unlikely(instinfo->epoch != session->reset_epoch)) {
+        if (instinfo->used) {
+            wasm_instance_stop(instinfo);
+        }
+        instinfo->epoch = session->reset_epoch;
+    }
+    // Only while idle, i.e. not used since the last transaction ended, as open
+    // aggregates, cursors and callers under host imports hold guest state
+    if (unlikely(instinfo->baseline) && session->host_depth == 0 &&
+        instinfo->last_checkout <= session->xact_clock &&
+        instinfo->module->tier_up.load(std::memory_order_relaxed) == WASM_TIER_UP_DONE) {
+        wasm_instance_stop(instinfo);
+    }
+    if (unlikely(instinfo->wasm_store == NULL)) {
+        wasm_instance_start(instinfo);
+    }
+    if (unlikely(!instinfo->pending_frees.empty()) && session->host_depth == 0) {
+        wasm_instance_release_states(instinfo);
+    }
+    instinfo->used = true;
+    instinfo->last_checkout = ++session->checkout_clock;
+}
+
+static std::shared_ptr<WasmModuleInfo> wasm_load_catalog_module(int64 instanceid);
+
+/*
+ * Return the current thread's instance of a registered module, instantiating
+ * it on first use. Returns NULL if no module is registered under that id.
+ */
+static WasmInstInfo* find_instance(int64 instanceid)
+{
+    WasmSessionState *session = wasm_get_session();
+    wasm_session_sync(session);
+
+    std::unordered_map<int64, WasmInstInfo*>::iterator itor = session->instances.find(instanceid);
+    if (itor != session->instances.end()) {
+        wasm_instance_checkout(itor->second);
+        return itor->second;
+    }
+
+    std::shared_ptr<WasmModuleInfo> module = wasm_find_module(instanceid);
+    if (!module) {
+        module = wasm_load_catalog_module(instanceid);
+    }
+    if (!module) {
+        elog(DEBUG1, "wasm_executor: not find instance info for instanceid %ld", instanceid);
+        return NULL;
+    }
+    WasmInstInfo *instinfo = new (std::nothrow)WasmInstInfo();
+    if (instinfo == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("wasm_executor: out of memory")));
+    }
+    instinfo->module = module;
+    instinfo->wasm_store = NULL;
+    instinfo->wasm_context = NULL;
+    instinfo->epoch = session->reset_epoch;
+    instinfo->used = false;
+    instinfo->stats = NULL;
+    instinfo->starts = 0;
+    instinfo->baseline = false;
+    instinfo->last_checkout = 0;
+    session->instances[instanceid] = instinfo;
+    wasm_stat_register(instinfo);
+    wasm_instance_checkout(instinfo);
+    return instinfo;
+}
+
+static WasmFuncInfo* find_exported_func(WasmModuleInfo *module, const char *funcname, size_t namelen)
+{
+    std::unordered_map<std::string, WasmFuncInfo*>::iterator itor =
+        module->function_index.find(std::string(funcname, namelen));
+    if (itor == module->function_index.end()) {
+        ereport(ERROR, (errmsg("wasm_executor: not find the exported function with name(%.*s) and namelen(%lu)",
+            (int)namelen, funcname, namelen)));
+    }
+    return itor->second;
+}
+
+/*
+ * Check whether instance pointers cached in fn_extra are still usable: same
+ * thread, none of its instances destroyed and no module dropped since.
+ */
+static inline bool wasm_cache_valid(WasmSessionState *session, uint64 generation, uint64 registry_generation)
+{
+    return session != NULL && session == wasm_session && session->generation == generation &&
+        registry_generation == wasm_registry_generation.load(std::memory_order_relaxed);
+}
+
+/*
+ * Call an export through the unchecked entry point. args_and_results must hold
+ * funcinfo->nraw slots whose kinds match the descriptor, which is guaranteed by
+ * the callers building them from funcinfo->params.
+ */
+static inline void wasm_call_raw(WasmInstInfo *instinfo, WasmFuncInfo *funcinfo, wasmtime_val_raw_t *args_and_results)
+{
+    wasm_prepare_call(instinfo);
+    WasmSessionState *session = wasm_session;
+    bool track = wasm_get_session_context()->track_functions;
+    wasm_trap_t *wasm_trap = NULL;
+    if (!track && !session->profile_call) {
+        wasmtime_error_t *error = wasmtime_func_call_unchecked(instinfo->wasm_context,
+            &instinfo->funcs[funcinfo->index], args_and_results, funcinfo->nraw, &wasm_trap);
+        if (error != NULL || wasm_trap != NULL) {
+            wasm_report_trap(instinfo, error, wasm_trap);
+        }
+        return;
+    }
+
+    uint64 outer_child_ns = session->stat_child_ns;
+    session->stat_child_ns = 0;
+    uint64 start_ns = wasm_clock_ns();
+    wasmtime_error_t *error = wasmtime_func_call_unchecked(instinfo->wasm_context, &instinfo->funcs[funcinfo->index],
+        args_and_results, funcinfo->nraw, &wasm_trap);
+    uint64 elapsed_ns = wasm_clock_ns() - start_ns;
+    session->last_call_ns = elapsed_ns;
+    if (!track) {
+        session->stat_child_ns = outer_child_ns + elapsed_ns;
+        if (error != NULL || wasm_trap != NULL) {
+            wasm_report_trap(instinfo, error, wasm_trap);
+        }
+        return;
+    }
+
+    WasmFuncStats *stats = &instinfo->stats[funcinfo->index];
+    wasm_stat_add(stats->calls, 1);
+    wasm_stat_add(stats->total_ns, elapsed_ns);
+    wasm_stat_add(stats->self_ns, elapsed_ns - Min(session->stat_child_ns, elapsed_ns));
+    int bucket = (elapsed_ns > 1) ? Min(63 - __builtin_clzll(elapsed_ns), WASM_STAT_BUCKETS - 1) : 0;
+    wasm_stat_add(stats->latency[bucket], 1);
+    session->stat_child_ns = outer_child_ns + elapsed_ns;
+
+    if (error != NULL || wasm_trap != NULL) {
+        wasm_stat_add(stats->traps, 1);
+        wasm_report_trap(instinfo, error, wasm_trap);
+    }
+}
+
+/*
+ * Decide whether the call entering the handler is sampled, see
+ * wasm.profile_sample_rate. Returns its start time, or 0 if it is not.
+ */
+static inline uint64 wasm_profile_begin(WasmSessionState *session)
+{
+    int rate = wasm_get_session_context()->profile_sample_rate;
+    session->profile_call = rate > 0 && --session->profile_countdown <= 0;
+    if (!session->profile_call) {
+        return 0;
+    }
+    session->profile_countdown = rate;
+    session->last_call_ns = 0;
+    return wasm_clock_ns();
+}
+
+static inline void wasm_profile_end(WasmSessionState *session, WasmInstInfo *instinfo, WasmFuncInfo *funcinfo,
+    uint64 start_ns)
+{
+    uint64 elapsed_ns = wasm_clock_ns() - start_ns;
+    WasmFuncStats *stats = &instinfo->stats[funcinfo->index];
+    wasm_stat_add(stats->sampled_calls, 1);
+    wasm_stat_add(stats->sampled_ns, elapsed_ns);
+    wasm_stat_add(stats->sampled_guest_ns, Min(session->last_call_ns, elapsed_ns));
+    session->profile_call = false;
+}
+
+/*
+ * wasm_invoke_function_N passes everything as bigint, which only fits exports
+ * over integers.
+ */
+static void wasm_check_integer_signature(WasmFuncInfo *funcinfo)
+{
+    for (wasm_valkind_t kind : funcinfo->params) {
+        if (kind != WASM_I32 && kind != WASM_I64) {
+            ereport(ERROR, (errmsg("wasm_executor: function %s takes floating point arguments, "
+                "call it through its LANGUAGE wasm function", funcinfo->funcname.c_str())));
+        }
+    }
+    if (!funcinfo->results.empty() && funcinfo->results[0] != WASM_I32 && funcinfo->results[0] != WASM_I64) {
+        ereport(ERROR, (errmsg("wasm_executor: function %s returns a floating point value, "
+            "call it through its LANGUAGE wasm function", funcinfo->funcname.c_str())));
+    }
+}
+
+static int64 wasm_invoke_function(WasmInstInfo *instinfo, WasmFuncInfo *funcinfo, const int64 *args, int nargs)
+{
+    if (!funcinfo->sqlcallable || funcinfo->params.size() != (size_t)nargs) {
+        ereport(ERROR, (errmsg("wasm_executor: function parameters not matched")));
+    }
+
+    wasmtime_val_raw_t args_and_results[funcinfo->nraw];
+    for (int i = 0; i < nargs; ++i) {
+        if (funcinfo->params[i] == WASM_I32) {
+            args_and_results[i].i32 = (int32)args[i];
+        } else {
+            args_and_results[i].i64 = args[i];
+        }
+    }
+
+    wasm_call_raw(instinfo, funcinfo, args_and_results);
+
+    if (funcinfo->results[0] == WASM_I32) {
+        return args_and_results[0].i32;
+    }
+    return args_and_results[0].i64;
+}
+
+/*
+ * Return a host pointer to size bytes of guest memory at ptr. The pointer is
+ * only valid until the next guest call, which may grow and move the memory.
+ */
+static uint8* wasm_guest_memory(WasmInstInfo *instinfo, uint32 ptr, size_t size)
+{
+    if (!instinfo->has_memory) {
+        ereport(ERROR, (errmsg("wasm_executor: module %s does not export \"%s\"",
+            instinfo->module->wasm_file.c_str(), WASM_MEMORY_EXPORT)));
+    }
+    size_t memsize = wasmtime_memory_data_size(instinfo->wasm_context, &instinfo->memory);
+    if ((size_t)ptr > memsize || size > memsize - ptr) {
+        ereport(ERROR, (errmsg("wasm_executor: guest buffer [%u, +%lu) is out of bounds of linear memory(%lu)",
+            ptr, size, memsize)));
+    }
+    return wasmtime_memory_data(instinfo->wasm_context, &instinfo->memory) + ptr;
+}
+
+/*
+ * Reserve size bytes of guest memory to marshal a call. The region comes from
+ * the guest's alloc export and is kept by the instance. It is reused by every
+ * call and only replaced when a call needs more, so steady-state calls do not
+ * allocate and the instance does not grow with the number of calls.
+ */
+static uint32 wasm_reserve_scratch(WasmInstInfo *instinfo, size_t size)
+{
+    if (size <= instinfo->scratch_size) {
+        return instinfo->scratch_ptr;
+    }
+
+    WasmModuleInfo *module = instinfo->module.get();
+    if (module->alloc_func == NULL || !instinfo->has_memory) {
+        ereport(ERROR, (errmsg("wasm_executor: module %s must export \"%s\" and \"%s(i32) -> i32\" to pass buffers",
+            module->wasm_file.c_str(), WASM_MEMORY_EXPORT, WASM_ALLOC_EXPORT)));
+    }
+    if (size > PG_INT32_MAX) {
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+            errmsg("wasm_executor: buffer of %lu bytes exceeds the guest address space", size)));
+    }
+
+    wasmtime_val_raw_t args_and_results[2];
+    if (instinfo->scratch_size > 0 && module->dealloc_func != NULL) {
+        args_and_results[0].i32 = (int32)instinfo->scratch_ptr;
+        args_and_results[1].i32 = (int32)instinfo->scratch_size;
+        wasm_call_raw(instinfo, module->dealloc_func, args_and_results);
+    }
+    instinfo->scratch_ptr = 0;
+    instinfo->scratch_size = 0;
+
+    size_t newsize = Max(Max(size, (size_t)WASM_SCRATCH_MIN_SIZE), Min((size_t)PG_INT32_MAX, size * 2));
+    args_and_results[0].i32 = (int32)newsize;
+    wasm_call_raw(instinfo, module->alloc_func, args_and_results);
+    uint32 ptr = (uint32)args_and_results[0].i32;
+    if (ptr == 0) {
+        ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY),
+            errmsg("wasm_executor: guest failed to allocate %lu bytes", newsize)));
+    }
+    (void)wasm_guest_memory(instinfo, ptr, newsize);
+
+    instinfo->scratch_ptr = ptr;
+    instinfo->scratch_size = (uint32)newsize;
+    return ptr;
+}
+
+/*
+ * Run a batch export over nrows rows with a single guest call. The input
+ * columns are copied into linear memory one after another, then the export is
+ * called as export(in_ptr i32, nrows i32, out_ptr i32) and must write nrows
+ * results of outwidth bytes at out_ptr, which are copied into out.
+ *
+ * With nulls, the export is called as export(in_ptr i32, nulls_ptr i32,
+ * nrows i32, out_ptr i32) and also gets the null flags of the rows, one byte
+ * per row set when an argument is null, like those of a column vector. The
+ * guest skips the flagged rows and may flag more to return null; the flags
+ * are copied back into nulls.
+ */
+static void wasm_call_batch(WasmInstInfo *instinfo, WasmFuncInfo *funcinfo, const WasmBatchColumn *columns,
+    int ncols, int nrows, char *out, int outwidth, uint8 *nulls)
+{
+    static const wasm_valkind_t batch_params[] = {WASM_I32, WASM_I32, WASM_I32, WASM_I32};
+    size_t nparams = (nulls != NULL) ? 4 : 3;
+    if (funcinfo->params.size() != nparams ||
+        !std::equal(batch_params, batch_params + nparams, funcinfo->params.begin())) {
+        ereport(ERROR, (errmsg("wasm_executor: batch function %s must take (in_ptr i32, %snrows i32, out_ptr i32)",
+            funcinfo->funcname.c_str(), (nulls != NULL) ? "nulls_ptr i32, " : "")));
+    }
+    if (nrows == 0) {
+        return;
+    }
+
+    size_t insize = 0;
+    for (int i = 0; i < ncols; i++) {
+        insize += (size_t)columns[i].width * nrows;
+    }
+    // The results stay aligned after the flags
+    size_t nullsize = (nulls != NULL) ? TYPEALIGN(sizeof(int64), nrows) : 0;
+    size_t outsize = (size_t)outwidth * nrows;
+    uint32 base = wasm_reserve_scratch(instinfo, insize + nullsize + outsize);
+
+    uint8 *data = wasm_guest_memory(instinfo, base, insize + nullsize + outsize);
+    for (int i = 0; i < ncols; i++) {
+        size_t colsize = (size_t)columns[i].width * nrows;
+        errno_t rc = memcpy_s(data, colsize, columns[i].data, colsize);
+        securec_check_c(rc, "\0", "\0");
+        data += colsize;
+    }
+    if (nulls != NULL) {
+        errno_t rc = memcpy_s(data, nullsize, nulls, nrows);
+        securec_check_c(rc, "\0", "\0");
+    }
+
+    wasmtime_val_raw_t args_and_results[Max(funcinfo->nraw, lengthof(batch_params))];
+    int arg = 0;
+    args_and_results[arg++].i32 = (int32)base;
+    if (nulls != NULL) {
+        args_and_results[arg++].i32 = (int32)(base + insize);
+    }
+    args_and_results[arg++].i32 = nrows;
+    args_and_results[arg++].i32 = (int32)(base + insize + nullsize);
+    wasm_call_raw(instinfo, funcinfo, args_and_results);
+
+    data = wasm_guest_memory(instinfo, base + insize, nullsize + outsize);
+    if (nulls != NULL) {
+        errno_t rc = memcpy_s(nulls, nrows, data, nrows);
+        securec_check_c(rc, "\0", "\0");
+    }
+    errno_t rc = memcpy_s(out, outsize, data + nullsize, outsize);
+    securec_check_c(rc, "\0", "\0");
+    wasm_stat_bytes(instinfo, funcinfo, insize + nullsize, nullsize + outsize);
+}
+
+/*
+ * Allocate a one-dimensional array without nulls whose data area the caller
+ * fills in directly.
+ */
+static ArrayType* wasm_alloc_array(Oid elemtype, int elemwidth, int nitems)
+{
+    if (nitems == 0) {
+        return construct_empty_array(elemtype);
+    }
+    Size nbytes = ARR_OVERHEAD_NONULLS(1) + (Size)elemwidth * nitems;
+    ArrayType *result = (ArrayType*)palloc0(nbytes);
+    SET_VARSIZE(result, nbytes);
+    result->ndim = 1;
+    result->dataoffset = 0;
+    result->elemtype = elemtype;
+    ARR_DIMS(result)[0] = nitems;
+    ARR_LBOUND(result)[0] = 1;
+    return result;
+}
+
+/*
+ * Check that a batch argument is a one-dimensional array of the expected
+ * length, without nulls unless allowed, and return its number of items.
+ */
+static int wasm_batch_array_items(ArrayType *array, int expected, bool allow_nulls)
+{
+    if (ARR_NDIM(array) > 1) {
+        ereport(ERROR, (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+            errmsg("wasm_executor: batch arguments must be one-dimensional arrays")));
+    }
+    if (ARR_HASNULL(array) && !allow_nulls) {
+        ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+            errmsg("wasm_executor: batch arguments must not contain nulls")));
+    }
+    int nitems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+    if (expected >= 0 && nitems != expected) {
+        ereport(ERROR, (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+            errmsg("wasm_executor: batch arguments must have the same length")));
+    }
+    return nitems;
+}
+
+/*
+ * SQL type of a wasm value kind, or NULL if it has no mapping. Generated
+ * wrappers use these; boolean and timestamp arguments need a hand-written
+ * LANGUAGE wasm function.
+ */
+static const char* wasm_valkind_sqltype(wasm_valkind_t kind)
+{
+    switch (kind) {
+        case WASM_I32:
+            return "integer";
+        case WASM_I64:
+            return "bigint";
+        case WASM_F32:
+            return "real";
+        case WASM_F64:
+            return "double precision";
+        default:
+            return NULL;
+    }
+}
+
+static bool wasm_signature_equals(WasmFuncInfo *funcinfo, const wasm_valkind_t *params, size_t nparams,
+    const wasm_valkind_t *results, size_t nresults)
+{
+    return funcinfo->params.size() == nparams && funcinfo->results.size() == nresults &&
+        std::equal(params, params + nparams, funcinfo->params.begin()) &&
+        std::equal(results, results + nresults, funcinfo->results.begin());
+}
+
+/*
+ * Build the call descriptor table of a module from its export types, so
+ * instances never need to inspect function types themselves.
+ */
+static void wasm_build_exported_funcs(WasmModuleInfo *module)
+{
+    wasm_exporttype_vec_t exports;
+    wasmtime_module_exports(module->wasm_module, &exports);
+
+    for (size_t i = 0; i < exports.size; ++i) {
+        const wasm_externtype_t *externtype = wasm_exporttype_type(exports.data[i]);
+        if (wasm_externtype_kind(externtype) != WASM_EXTERN_FUNC) {
+            continue;
+        }
+        const wasm_functype_t *wasm_functype = wasm_externtype_as_functype_const(externtype);
+        const wasm_name_t *export_name = wasm_exporttype_name(exports.data[i]);
+        WasmFuncInfo *funcinfo = new(std::nothrow)WasmFuncInfo();
+
+        const wasm_valtype_vec_t* wasm_results = wasm_functype_results(wasm_functype);
+        const wasm_valtype_vec_t* wasm_params = wasm_functype_params(wasm_functype);
+        for (unsigned int j = 0; j < wasm_results->size; ++j) {
+            funcinfo->results.push_back(wasm_valtype_kind(wasm_results->data[j]));
+        }
+        for (unsigned int j = 0; j < wasm_params->size; ++j) {
+            funcinfo->params.push_back(wasm_valtype_kind(wasm_params->data[j]));
+        }
+
+        funcinfo->funcname = std::string(export_name->data, export_name->size);
+        funcinfo->index = module->functions.size();
+        funcinfo->nraw = Max(funcinfo->params.size(), funcinfo->results.size());
+        module->functions.push_back(funcinfo);
+        module->function_index[funcinfo->funcname] = funcinfo;
+    }
+    wasm_exporttype_vec_delete(&exports);
+
+    /*
+     * Exports which do not map to a scalar SQL function, e.g. batch entry
+     * points or the allocator, stay callable from C but get no SQL wrapper.
+     * A multi-value export lists one output per result and is wrapped as a
+     * function returning a record.
+     */
+    for (WasmFuncInfo *funcinfo : module->functions) {
+        funcinfo->sqlcallable = (funcinfo->results.size() >= 1 && funcinfo->params.size() <= FUNC_MAX_ARGS);
+        for (unsigned int i = 0; i < funcinfo->results.size() && funcinfo->sqlcallable; ++i) {
+            const char *output = wasm_valkind_sqltype(funcinfo->results[i]);
+            if (output == NULL) {
+                funcinfo->sqlcallable = false;
+                break;
+            }
+            funcinfo->outputs += output;
+            funcinfo->outputs += ",";
+        }
+        if (funcinfo->outputs.length() > 0) {
+            funcinfo->outputs.pop_back();
+        }
+        for (unsigned int i = 0; i < funcinfo->params.size() && funcinfo->sqlcallable; ++i) {
+            const char *input = wasm_valkind_sqltype(funcinfo->params[i]);
+            if (input == NULL) {
+                funcinfo->sqlcallable = false;
+                break;
+            }
+            funcinfo->inputs += input;
+            funcinfo->inputs += ",";
+        }
+        if (funcinfo->inputs.length() > 0) {
+            funcinfo->inputs.pop_back();
+        }
+        if (!funcinfo->sqlcallable) {
+            funcinfo->inputs.clear();
+            funcinfo->outputs.clear();
+            elog(DEBUG1, "wasm_executor: export %s of %s has no SQL mapping", funcinfo->funcname.c_str(),
+                module->wasm_file.c_str());
+        }
+    }
+
+    static const wasm_valkind_t alloc_params[] = {WASM_I32};
+    static const wasm_valkind_t alloc_results[] = {WASM_I32};
+    static const wasm_valkind_t dealloc_params[] = {WASM_I32, WASM_I32};
+    std::unordered_map<std::string, WasmFuncInfo*>::iterator itor = module->function_index.find(WASM_ALLOC_EXPORT);
+    if (itor != module->function_index.end() &&
+        wasm_signature_equals(itor->second, alloc_params, lengthof(alloc_params), alloc_results, lengthof(alloc_results))) {
+        module->alloc_func = itor->second;
+    }
+    itor = module->function_index.find(WASM_DEALLOC_EXPORT);
+    if (itor != module->function_index.end() &&
+        wasm_signature_equals(itor->second, dealloc_params, lengthof(dealloc_params), NULL, 0)) {
+        module->dealloc_func = itor->second;
+    }
+    elog(DEBUG1, "wasm_executor:init exported func info for %s", module->wasm_file.c_str());
+}
+
+static void wasm_export_funcs_query(int64 instanceid, TupleFuncState* inter_call_data, FuncCallContext* fctx)
+{
+    std::shared_ptr<WasmModuleInfo> module = wasm_find_module(instanceid);
+    if (!module) {
+        ereport(ERROR, (errmsg("wasm_executor: instance with id %ld is not find", instanceid)));
+    }
+
+    size_t nfuncs = 0;
+    inter_call_data->funcnames = (char**)palloc(sizeof(char*) * (module->functions.size() + 1));
+    inter_call_data->inputs = (char**)palloc(sizeof(char*) * (module->functions.size() + 1));
+    inter_call_data->outputs = (char**)palloc(sizeof(char*) * (module->functions.size() + 1));
+    for (WasmFuncInfo *funcinfo : module->functions) {
+        if (!funcinfo->sqlcallable) {
+            continue;
+        }
+        inter_call_data->funcnames[nfuncs] = pstrdup(funcinfo->funcname.c_str());
+        inter_call_data->inputs[nfuncs] = pstrdup(funcinfo->inputs.c_str());
+        inter_call_data->outputs[nfuncs] = pstrdup(funcinfo->outputs.c_str());
+        nfuncs++;
+    }
+    fctx->max_calls = nfuncs;
+}
+
+/*
+ * Describe the engine settings which affect the generated code. It is part of
+ * the cache key, so artifacts compiled under other settings are never picked up.
+ */
+static std::string wasm_engine_config_key()
+{
+    (void)wasm_get_engine();
+    const WasmEngineSettings &settings = wasm_engine_settings;
+    return std::string(WASM_ENGINE_VERSION) + ";cranelift;opt=" + std::to_string(settings.opt_level) +
+        ";simd=" + std::to_string(settings.simd) + ";bulk=" + std::to_string(settings.bulk_memory) +
+        ";static=" + std::to_string(settings.static_memory_maximum_size) +
+        ";guard=" + std::to_string(settings.static_memory_guard_size) + "/" +
+        std::to_string(settings.dynamic_memory_guard_size) + ";epoch" + (settings.fuel ? ";fuel" : "");
+}
+
+/*
+ * Path of the compiled artifact of a module, keyed by the md5 of the module
+ * bytes and the md5 of the engine config.
+ */
+static void wasm_module_hash(const uint8 *data, size_t size, char *hash)
+{
+    if (!pg_md5_hash(data, size, hash)) {
+        ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("wasm_executor: out of memory")));
+    }
+}
+
+static std::string wasm_cache_artifact_path(const uint8 *data, size_t size)
+{
+    char module_hash[WASM_MD5_HEX_LEN + 1];
+    char config_hash[WASM_MD5_HEX_LEN + 1];
+    std::string config_key = wasm_engine_config_key();
+
+    wasm_module_hash(data, size, module_hash);
+    wasm_module_hash((const uint8*)config_key.c_str(), config_key.length(), config_hash);
+
+    std::string cache_dir = std::string(t_thrd.proc_cxt.DataDir) + "/" + WASM_CACHE_DIR;
+    if (mkdir(cache_dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+        ereport(WARNING, (errcode_for_file_access(),
+            errmsg("wasm_executor: could not create directory \"%s\": %m", cache_dir.c_str())));
+    }
+    return cache_dir + "/" + module_hash + "_" + config_hash + WASM_CACHE_SUFFIX;
+}
+
+/*
+ * Store the compiled code of a module. The artifact is written to a temporary
+ * file and renamed into place, so concurrent readers never see a partial file.
+ * Failures only cost a recompile later, so they are not fatal. It does not
+ * ereport, as background compiles write artifacts too.
+ */
+static bool wasm_cache_write(wasmtime_module_t *module, const std::string &artifact)
+{
+    wasm_byte_vec_t serialized;
+    wasmtime_error_t *error_msg = wasmtime_module_serialize(module, &serialized);
+    if (error_msg != NULL) {
+        wasmtime_error_delete(error_msg);
+        return false;
+    }
+
+    std::string tmpfile = artifact + ".tmp." + std::to_string((unsigned long)pthread_self());
+    FILE *file = fopen(tmpfile.c_str(), "wb");
+    bool ok = (file != NULL);
+    if (ok) {
+        ok = (fwrite(serialized.data, serialized.size, 1, file) == 1);
+        ok = (fclose(file) == 0) && ok;
+    }
+    if (ok) {
+        ok = (rename(tmpfile.c_str(), artifact.c_str()) == 0);
+    }
+    if (!ok) {
+        int save_errno = errno;
+        (void)unlink(tmpfile.c_str());
+        errno = save_errno;
+    }
+    wasm_byte_vec_delete(&serialized);
+    return ok;
+}
+
+static void wasm_cache_store(wasmtime_module_t *module, const std::string &artifact)
+{
+    if (!wasm_cache_write(module, artifact)) {
+        ereport(WARNING, (errcode_for_file_access(),
+            errmsg("wasm_executor: could not write compiled module \"%s\": %m", artifact.c_str())));
+    }
+}
+
+/*
+ * Tiered compilation applies to modules created or loaded by sessions. Those
+ * preloaded at server start are compiled optimized right away.
+ */
+static bool wasm_tiered_compilation()
+{
+    return !process_shared_preload_libraries_in_progress && wasm_get_session_context()->tiered_compilation;
+}
+
+/*
+ * Compile the optimized code of a module in a background thread, while its
+ * instances run baseline code. Sessions swap it in when they next check out
+ * an instance, see wasm_instance_checkout. The thread keeps the module alive
+ * and writes the artifact, so the module is optimized right away next time.
+ */
+static void wasm_tier_up(const std::shared_ptr<WasmModuleInfo> &module, std::vector<uint8> &&bytes,
+    const std::string &artifact)
+{
+    wasm_engine_t *engine = wasm_get_engine();
+    std::shared_ptr<std::vector<uint8>> code = std::make_shared<std::vector<uint8>>(std::move(bytes));
+    module->tier_up.store(WASM_TIER_UP_COMPILING, std::memory_order_relaxed);
+    bool started = wasm_start_thread([module, code, artifact, engine]() {
+        uint64 start_ns = wasm_clock_ns();
+        wasmtime_module_t *optimized = NULL;
+        wasmtime_error_t *error_msg = wasmtime_module_new(engine, code->data(), code->size(), &optimized);
+        if (error_msg != NULL) {
+            wasmtime_error_delete(error_msg);
+        }
+        if (optimized == NULL) {
+            module->tier_up.store(WASM_TIER_UP_FAILED, std::memory_order_release);
+            return;
+        }
+        (void)wasm_cache_write(optimized, artifact);
+        module->tier_up_ns = wasm_clock_ns() - start_ns;
+        module->optimized_module = optimized;
+        module->tier_up.store(WASM_TIER_UP_DONE, std::memory_order_release);
+    });
+    if (!started) {
+        module->tier_up.store(WASM_TIER_UP_FAILED, std::memory_order_relaxed);
+        ereport(WARNING, (errmsg("wasm_executor: could not start the optimized compile of %s",
+            module->wasm_file.c_str())));
+    }
+}
+
+static void wasm_compile_baseline(const std::shared_ptr<WasmModuleInfo> &module, const uint8 *data, size_t size,
+    const std::string &artifact)
+{
+    wasm_engine_t *engine = wasm_get_baseline_engine();
+    wasmtime_module_t *compiled = NULL;
+    wasmtime_error_t *error_msg = wasmtime_module_new(engine, data, size, &compiled);
+    if (compiled == NULL) {
+        exit_with_error("failed to compile module", error_msg, NULL);
+    }
+    module->wasm_module = compiled;
+    module->engine = engine;
+    wasm_tier_up(module, std::vector<uint8>(data, data + size), artifact);
+}
+
+/*
+ * Compile the code of a module from the given bytes. A cached artifact is mapped
+ * directly when present; otherwise the module is compiled and the artifact is
+ * written for the next session or restart. Artifacts made by another wasmtime
+ * version or config are rejected by wasmtime and simply recompiled. With
+ * wasm.tiered_compilation, a module missing from the cache is compiled
+ * without optimizations and optimized in the background.
+ */
+static void wasm_compile_module(const std::shared_ptr<WasmModuleInfo> &module, const uint8 *data, size_t size)
+{
+    wasm_engine_t *engine = wasm_get_engine();
+    std::string artifact = wasm_cache_artifact_path(data, size);
+    wasmtime_module_t *compiled = NULL;
+
+    wasmtime_error_t *error_msg = wasmtime_module_deserialize_file(engine, artifact.c_str(), &compiled);
+    module->compiled_from_cache = (error_msg == NULL && compiled != NULL);
+    if (module->compiled_from_cache) {
+        elog(DEBUG1, "wasm_executor: loaded compiled module from %s", artifact.c_str());
+        module->wasm_module = compiled;
+        module->engine = engine;
+        return;
+    }
+    if (error_msg != NULL) {
+        wasmtime_error_delete(error_msg);
+    }
+
+    if (wasm_tiered_compilation()) {
+        wasm_compile_baseline(module, data, size, artifact);
+        return;
+    }
+
+    compiled = NULL;
+    error_msg = wasmtime_module_new(engine, data, size, &compiled);
+    if (compiled == NULL) {
+        exit_with_error("failed to compile module", error_msg, NULL);
+    }
+    wasm_cache_store(compiled, artifact);
+    module->wasm_module = compiled;
+    module->engine = engine;
+}
+
+/*
+ * Compile a module from a wasm binary or wat text and build its call
+ * descriptors, without publishing it.
+ */
+static std::shared_ptr<WasmModuleInfo> wasm_build_module(int64 id, const char *name, const uint8 *data, size_t size)
+{
+    wasm_byte_vec_t wat_bytes;
+    bool is_wat = (size < 4 || memcmp(data, "\0asm", 4) != 0);
+    if (is_wat) {
+        wasmtime_error_t *error_msg = wasmtime_wat2wasm((const char*)data, size, &wat_bytes);
+        if (error_msg != NULL) {
+            exit_with_error("failed to parse wat", error_msg, NULL);
+        }
+        data = (const uint8*)wat_bytes.data;
+        size = wat_bytes.size;
+    }
+
+    std::shared_ptr<WasmModuleInfo> module = std::make_shared<WasmModuleInfo>();
+    module->id = id;
+    module->wasm_file = name;
+    uint64 start_ns = wasm_clock_ns();
+    wasm_compile_module(module, data, size);
+    module->compile_ns = wasm_clock_ns() - start_ns;
+    if (is_wat) {
+        wasm_byte_vec_delete(&wat_bytes);
+    }
+    wasm_build_exported_funcs(module.get());
+    return module;
+}
+
+/*
+ * Compile and publish a module. Returns the published module, which is an
+ * earlier one if another session was faster.
+ */
+static std::shared_ptr<WasmModuleInfo> wasm_load_module(int64 id, const char *name, const uint8 *data, size_t size)
+{
+    return wasm_publish_module(wasm_build_module(id, name, data, size));
+}
+
+/*
+ * Load a module file through a read-only mapping, so it is compiled without
+ * being copied to the heap first.
+ */
+static std::shared_ptr<WasmModuleInfo> wasm_build_module_file(int64 id, const char *filepath)
+{
+    int fd = open(filepath, O_RDONLY, 0);
+    if (fd < 0) {
+        ereport(ERROR, (errcode_for_file_access(), errmsg("wasm_executor: unable to open file %s", filepath)));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        (void)close(fd);
+        ereport(ERROR, (errmsg("wasm_executor: failed to load moude from %s", filepath)));
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void)close(fd);
+    if (data == MAP_FAILED) {
+        ereport(ERROR, (errcode_for_file_access(), errmsg("wasm_executor: could not map file %s: %m", filepath)));
+    }
+
+    std::shared_ptr<WasmModuleInfo> module;
+    PG_TRY();
+    {
+        module = wasm_build_module(id, filepath, (const uint8*)data, size);
+    }
+    PG_CATCH();
+    {
+        (void)munmap(data, size);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    (void)munmap(data, size);
+    return module;
+}
+
+static std::shared_ptr<WasmModuleInfo> wasm_load_module_file(int64 id, const char *filepath)
+{
+    return wasm_publish_module(wasm_build_module_file(id, filepath));
+}
+
+/*
+ * Load a module which is not in the registry of this process yet, e.g. on a
+ * standby or after a restart. A module created from bytea is read from
+ * wasm.modules, which replicates with the database; others are loaded from
+ * the file they were created from.
+ */
+static std::shared_ptr<WasmModuleInfo> wasm_load_catalog_module(int64 instanceid)
+{
+    std::shared_ptr<WasmModuleInfo> module;
+    if (SPI_connect() != SPI_OK_CONNECT) {
+        ereport(ERROR, (errmsg("wasm_executor: SPI_connect failed")));
+    }
+
+    Oid argtypes[1] = {INT8OID};
+    Datum values[1] = {Int64GetDatum(instanceid)};
+    int ret = SPI_execute_with_args("SELECT i.wasm_file, m.module, i.version FROM wasm.instances i "
+        "LEFT JOIN wasm.modules m ON m.id = i.id WHERE i.id = $1 LIMIT 1",
+        1, argtypes, values, NULL, true, 1);
+    if (ret == SPI_OK_SELECT && SPI_processed > 0) {
+        HeapTuple tuple = SPI_tuptable->vals[0];
+        TupleDesc tupdesc = SPI_tuptable->tupdesc;
+        bool isnull = false;
+        Datum filedatum = SPI_getbinval(tuple, tupdesc, 1, &isnull);
+        char *wasm_file = isnull ? NULL : TextDatumGetCString(filedatum);
+        Datum versiondatum = SPI_getbinval(tuple, tupdesc, 3, &isnull);
+        int64 version = isnull ? 1 : DatumGetInt64(versiondatum);
+        Datum bytesdatum = SPI_getbinval(tuple, tupdesc, 2, &isnull);
+        if (!isnull && wasm_file != NULL) {
+            bytea *bytes = DatumGetByteaPP(bytesdatum);
+            module = wasm_build_module(instanceid, wasm_file, (const uint8*)VARDATA_ANY(bytes),
+                VARSIZE_ANY_EXHDR(bytes));
+        } else if (wasm_file != NULL) {
+            module = wasm_build_module_file(instanceid, wasm_file);
+        }
+        if (module) {
+            module->version = version;
+            module = wasm_publish_module(module);
+        }
+    }
+
+    SPI_finish();
+    if (module) {
+        elog(DEBUG1, "wasm_executor: loaded module %s on first use", module->wasm_file.c_str());
+    }
+    return module;
+}
+
+static Datum wasm_create_instance_internal(FunctionCallInfo fcinfo)
+{
+    text *arg = PG_GETARG_TEXT_P(0);
+    char* filepath = text_to_cstring(arg);
+    canonicalize_path(filepath);
+    // Same id as wasm.preload_modules and 'path:export' bodies give the file
+    int64 uuid = generate_uuid(CStringGetTextDatum(filepath));
+    
+    if (!superuser())
+        ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE), (errmsg("wasm_executor: must be system admin to create wasm instance"))));
+
+    std::shared_ptr<WasmModuleInfo> module = wasm_find_module(uuid);
+    if (module) {
+        ereport(NOTICE, (errmsg("wasm_executor: instance already created for %s", filepath)));
+        return Int64GetDatum(uuid);
+    }
+
+    (void)wasm_load_module_file(uuid, filepath);
+
+    // Instantiate in this thread right away, so errors surface at creation
+    if (find_instance(uuid) == NULL) {
+        ereport(ERROR, (errmsg("wasm_executor: instance with id %ld is not find", uuid)));
+    }
+
+    return Int64GetDatum(uuid);
+}
+
+PG_FUNCTION_INFO_V1(wasm_create_instance_wat);
+Datum wasm_create_instance_wat(PG_FUNCTION_ARGS) 
+{
+    return wasm_create_instance_internal(fcinfo);
+}
+
+PG_FUNCTION_INFO_V1(wasm_create_instance);
+Datum wasm_create_instance(PG_FUNCTION_ARGS) 
+{
+    return wasm_create_instance_internal(fcinfo);
+}
+
+/*
+ * Create an instance from the bytes of a module. Its name and id derive from
+ * the md5 of the content, which is also its key in wasm.modules.
+ */
+PG_FUNCTION_INFO_V1(wasm_create_instance_bytea);
+Datum wasm_create_instance_bytea(PG_FUNCTION_ARGS)
+{
+    bytea *bytes = PG_GETARG_BYTEA_PP(0);
+    if (!superuser())
+        ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE), (errmsg("wasm_executor: must be system admin to create wasm instance"))));
+
+    const uint8 *data = (const uint8*)VARDATA_ANY(bytes);
+    size_t size = VARSIZE_ANY_EXHDR(bytes);
+    char module_hash[WASM_MD5_HEX_LEN + 1];
+    wasm_module_hash(data, size, module_hash);
+    std::string name = std::string(WASM_CATALOG_PREFIX) + module_hash;
+    int64 uuid = generate_uuid(CStringGetTextDatum(name.c_str()));
+
+    if (wasm_find_module(uuid)) {
+        ereport(NOTICE, (errmsg("wasm_executor: instance already created for %s", name.c_str())));
+        return Int64GetDatum(uuid);
+    }
+    (void)wasm_load_module(uuid, name.c_str(), data, size);
+
+    if (find_instance(uuid) == NULL) {
+        ereport(ERROR, (errmsg("wasm_executor: instance with id %ld is not find", uuid)));
+    }
+    return Int64GetDatum(uuid);
+}
+
+/*
+ * With wasm_executor in shared_preload_libraries, compile the modules listed
+ * in wasm.preload_modules at postmaster start, or load them from the compiled
+ * module cache. All sessions run in this process and find them in the
+ * registry, so the first query after a restart or failover compiles nothing.
+ * A module which fails to load is reported and skipped. The catalog cannot be
+ * read this early, so preloaded modules are published as version 1.
+ */
+void _PG_init(void)
+{
+    if (!process_shared_preload_libraries_in_progress) {
+        return;
+    }
+    const char *value = GetConfigOption("wasm.preload_modules", true, false);
+    if (value == NULL) {
+        return;
+    }
+
+    std::string modules(value);
+    size_t start = 0;
+    while (start <= modules.length()) {
+        size_t end = modules.find(',', start);
+        if (end == std::string::npos) {
+            end = modules.length();
+        }
+        size_t first = modules.find_first_not_of(" \t", start);
+        size_t last = modules.find_last_not_of(" \t", end - 1);
+        if (first != std::string::npos && first < end && last >= first) {
+            char *filepath = pstrdup(modules.substr(first, last - first + 1).c_str());
+            canonicalize_path(filepath);
+            int64 uuid = generate_uuid(CStringGetTextDatum(filepath));
+            PG_TRY();
+            {
+                if (!wasm_find_module(uuid)) {
+                    std::shared_ptr<WasmModuleInfo> module = wasm_load_module_file(uuid, filepath);
+                    ereport(LOG, (errmsg("wasm_executor: preloaded %s%s", filepath,
+                        module->compiled_from_cache ? " from the compiled module cache" : "")));
+                }
+            }
+            PG_CATCH();
+            {
+                EmitErrorReport();
+                FlushErrorState();
+            }
+            PG_END_TRY();
+            pfree(filepath);
+        }
+        start = end + 1;
+    }
+}
+
+PG_FUNCTION_INFO_V1(wasm_drop_instance);
+Datum wasm_drop_instance(PG_FUNCTION_ARGS) 
+{
+    int64 instanceid = PG_GETARG_INT64(0);
+    Datum module_path;
+    
+    if (!superuser())
+        ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE), (errmsg("wasm_executor: must be system admin to delete wasm instance"))));
+
+    std::shared_ptr<WasmModuleInfo> module = wasm_unpublish_module(instanceid);
+    if (!module) {
+        ereport(ERROR, (errmsg("wasm_executor:instance with id=%ld not exist", instanceid)));
+    }
+    module_path = CStringGetTextDatum(module->wasm_file.c_str());
+    
+    return module_path;
+}
+
+/*
+ * Every export of the running version may be called by a SQL function, so a
+ * new version has to keep all of them with the same signatures.
+ */
+static void wasm_check_reload_compatible(WasmModuleInfo *current, WasmModuleInfo *module)
+{
+    for (WasmFuncInfo *funcinfo : current->functions) {
+        std::unordered_map<std::string, WasmFuncInfo*>::iterator itor =
+            module->function_index.find(funcinfo->funcname);
+        if (itor == module->function_index.end() || itor->second->params != funcinfo->params ||
+            itor->second->results != funcinfo->results) {
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("wasm_executor: %s does not export %s(%s) -> %s like version %ld of instance %ld",
+                    module->wasm_file.c_str(), funcinfo->funcname.c_str(), funcinfo->inputs.c_str(),
+                    funcinfo->outputs.c_str(), current->version, current->id),
+                errhint("Register the new module as a new instance instead.")));
+        }
+    }
+}
+
+/*
+ * Queue a new version of a module, compiled by the caller. Sessions keep
+ * calling the current version meanwhile, and the new one replaces it when
+ * the transaction commits.
+ */
+static Datum wasm_reload_module_internal(std::shared_ptr<WasmModuleInfo> module, int64 version)
+{
+    std::shared_ptr<WasmModuleInfo> current = wasm_find_module(module->id);
+    if (!current) {
+        current = wasm_load_catalog_module(module->id);
+    }
+    PG_TRY();
+    {
+        if (!current) {
+            ereport(ERROR, (errmsg("wasm_executor:instance with id=%ld not exist", module->id)));
+        }
+        wasm_check_reload_compatible(current.get(), module.get());
+    }
+    PG_CATCH();
+    {
+        module.reset();
+        current.reset();
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    module->version = version;
+    // Registers the transaction callback which publishes it
+    (void)wasm_get_session();
+    {
+        std::lock_guard<std::mutex> guard(wasm_pending_lock);
+        std::vector<std::shared_ptr<WasmModuleInfo>> &reloads = wasm_pending_reloads[u_sess->session_id];
+        if (reloads.empty()) {
+            wasm_pending_count.fetch_add(1);
+        }
+        reloads.push_back(module);
+    }
+    ereport(DEBUG1, (errmsg("wasm_executor: compiled version %ld of instance %ld from %s%s", version, module->id,
+        module->wasm_file.c_str(), module->compiled_from_cache ? " (cached)" : "")));
+    return CStringGetTextDatum(module->wasm_file.c_str());
+}
+
+PG_FUNCTION_INFO_V1(wasm_reload_module);
+Datum wasm_reload_module(PG_FUNCTION_ARGS)
+{
+    int64 instanceid = PG_GETARG_INT64(0);
+    char *filepath = text_to_cstring(PG_GETARG_TEXT_P(1));
+    int64 version = PG_GETARG_INT64(2);
+    canonicalize_path(filepath);
+
+    if (!superuser())
+        ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE), (errmsg("wasm_executor: must be system admin to reload wasm instance"))));
+
+    return wasm_reload_module_internal(wasm_build_module_file(instanceid, filepath), version);
+}
+
+PG_FUNCTION_INFO_V1(wasm_reload_module_bytea);
+Datum wasm_reload_module_bytea(PG_FUNCTION_ARGS)
+{
+    int64 instanceid = PG_GETARG_INT64(0);
+    bytea *bytes = PG_GETARG_BYTEA_PP(1);
+    int64 version = PG_GETARG_INT64(2);
+
+    if (!superuser())
+        ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE), (errmsg("wasm_executor: must be system admin to reload wasm instance"))));
+
+    const uint8 *data = (const uint8*)VARDATA_ANY(bytes);
+    size_t size = VARSIZE_ANY_EXHDR(bytes);
+    char module_hash[WASM_MD5_HEX_LEN + 1];
+    wasm_module_hash(data, size, module_hash);
+    std::string name = std::string(WASM_CATALOG_PREFIX) + module_hash;
+    return wasm_reload_module_internal(wasm_build_module(instanceid, name.c_str(), data, size), version);
+}
+
+PG_FUNCTION_INFO_V1(wasm_get_instances);
+Datum wasm_get_instances(PG_FUNCTION_ARGS) 
+{
+    FuncCallContext* fctx = NULL;
+    TupleInstanceState* inter_call_data = NULL;
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+        MemoryContext mctx;
+
+        fctx = SRF_FIRSTCALL_INIT();
+        mctx = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+        inter_call_data = (TupleInstanceState*)palloc(sizeof(TupleInstanceState));
+
+        /* Build a tuple descriptor for our result type */
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            elog(ERROR, "wasm_executor: return type must be a row type");
+
+        inter_call_data->tupd = tupdesc;
+
+        // Copy the current snapshot, the registry may change between calls
+        std::shared_ptr<const WasmModuleMap> modules = std::atomic_load(&wasm_modules);
+        inter_call_data->ids = (int64*)palloc(sizeof(int64) * (modules->size() + 1));
+        inter_call_data->files = (char**)palloc(sizeof(char*) * (modules->size() + 1));
+        int nmodules = 0;
+        for (const WasmModuleMap::value_type &entry : *modules) {
+            inter_call_data->ids[nmodules] = entry.first;
+            inter_call_data->files[nmodules] = pstrdup(entry.second->wasm_file.c_str());
+            nmodules++;
+        }
+        fctx->max_calls = nmodules;
+
+        fctx->user_fctx = inter_call_data;
+        MemoryContextSwitchTo(mctx);
+    }
+
+    fctx = SRF_PERCALL_SETUP();
+    inter_call_data = (TupleInstanceState*)(fctx->user_fctx);
+    
+    if (fctx->call_cntr < fctx->max_calls) {
+        HeapTuple resultTuple;
+        Datum result;
+        Datum values[2];
+        bool nulls[2];
+
+        errno_t rc = memset_s(nulls, sizeof(nulls), 0, sizeof(nulls));
+        securec_check_c(rc, "\0", "\0");
+
+        values[0] = Int64GetDatum(inter_call_data->ids[fctx->call_cntr]);
+        values[1] = CStringGetTextDatum(inter_call_data->files[fctx->call_cntr]);
+
+        /* Build and return the result tuple. */
+        resultTuple = heap_form_tuple(inter_call_data->tupd, values, nulls);
+        result = HeapTupleGetDatum(resultTuple);
+
+        SRF_RETURN_NEXT(fctx, result);
+    } else {
+        SRF_RETURN_DONE(fctx);
+    }
+}
+
+PG_FUNCTION_INFO_V1(wasm_get_exported_functions);
+Datum wasm_get_exported_functions(PG_FUNCTION_ARGS) 
+{
+    int64 instanceid = PG_GETARG_INT64(0);
+    FuncCallContext* fctx = NULL;
+    TupleFuncState* inter_call_data = NULL;
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+        MemoryContext mctx;
+
+        fctx = SRF_FIRSTCALL_INIT();
+        mctx = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+        inter_call_data = (TupleFuncState*)palloc(sizeof(TupleFuncState));
+        
+        /* Build a tuple descriptor for our result type */
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            elog(ERROR, "wasm_executor: return type must be a row type");
+
+        inter_call_data->tupd = tupdesc;
+        wasm_export_funcs_query(instanceid, inter_call_data, fctx);
+
+        fctx->user_fctx = inter_call_data;
+        MemoryContextSwitchTo(mctx);
+    }
+    fctx = SRF_PERCALL_SETUP();
+    inter_call_data = (TupleFuncState*)(fctx->user_fctx);
+    
+    if (fctx->call_cntr < fctx->max_calls) {
+        HeapTuple resultTuple;
+        Datum result;
+        Datum values[3];
+        bool nulls[3];
+
+        errno_t rc = memset_s(nulls, sizeof(nulls), 0, sizeof(nulls));
+        securec_check_c(rc, "\0", "\0");
+
+        values[0] = CStringGetTextDatum(inter_call_data->funcnames[fctx->call_cntr]);
+        values[1] = CStringGetTextDatum(inter_call_data->inputs[fctx->call_cntr]);
+        values[2] = CStringGetTextDatum(inter_call_data->outputs[fctx->call_cntr]);
+
+        /* Build and return the result tuple. */
+        resultTuple = heap_form_tuple(inter_call_data->tupd, values, nulls);
+        result = HeapTupleGetDatum(resultTuple);
+
+        SRF_RETURN_NEXT(fctx, result);
+    } else {
+        SRF_RETURN_DONE(fctx);
+    }
+}
+
+/*
+ * Resolve the instance and export named by the first two arguments of
+ * wasm_invoke_function_N. The result is cached in fn_extra, and later calls
+ * only compare the argument bytes with the cached key.
+ */
+static WasmInvokeCache* wasm_invoke_cache_lookup(FunctionCallInfo fcinfo)
+{
+    text *instanceid_text = PG_GETARG_TEXT_PP(0);
+    text *funcname_text = PG_GETARG_TEXT_PP(1);
+    size_t idlen = VARSIZE_ANY_EXHDR(instanceid_text);
+    size_t namelen = VARSIZE_ANY_EXHDR(funcname_text);
+
+    WasmInvokeCache *cache = (WasmInvokeCache*)fcinfo->flinfo->fn_extra;
+    if (cache != NULL && wasm_cache_valid(cache->session, cache->generation, cache->registry_generation) &&
+        idlen < sizeof(cache->instanceid) && cache->instanceid[idlen] == '\0' &&
+        memcmp(cache->instanceid, VARDATA_ANY(instanceid_text), idlen) == 0 &&
+        cache->funcinfo->funcname.compare(0, std::string::npos, VARDATA_ANY(funcname_text), namelen) == 0) {
+        wasm_instance_checkout(cache->instinfo);
+        return cache;
+    }
+
+    if (idlen >= sizeof(cache->instanceid)) {
+        ereport(ERROR, (errmsg("wasm_executor: invalid instance id")));
+    }
+    if (cache == NULL) {
+        cache = (WasmInvokeCache*)MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt, sizeof(WasmInvokeCache));
+    }
+    errno_t rc = memset_s(cache->instanceid, sizeof(cache->instanceid), 0, sizeof(cache->instanceid));
+    securec_check_c(rc, "\0", "\0");
+    rc = memcpy_s(cache->instanceid, sizeof(cache->instanceid), VARDATA_ANY(instanceid_text), idlen);
+    securec_check_c(rc, "\0", "\0");
+
+    int64 instanceid = atol(cache->instanceid);
+    cache->session = NULL;
+    cache->instinfo = find_instance(instanceid);
+    if (cache->instinfo == NULL) {
+        ereport(ERROR, (errmsg("wasm_executor: instance with id %ld is not find", instanceid)));
+    }
+    cache->funcinfo = find_exported_func(cache->instinfo->module.get(), VARDATA_ANY(funcname_text), namelen);
+    wasm_check_integer_signature(cache->funcinfo);
+    cache->session = wasm_session;
+    cache->generation = wasm_session->generation;
+    cache->registry_generation = wasm_session->registry_generation;
+    fcinfo->flinfo->fn_extra = cache;
+    return cache;
+}
+
+static Datum wasm_invoke_function_args(FunctionCallInfo fcinfo, const int64 *args, int nargs)
+{
+    WasmInvokeCache *cache = wasm_invoke_cache_lookup(fcinfo);
+    int64 result = wasm_invoke_function(cache->instinfo, cache->funcinfo, args, nargs);
+    return Int64GetDatum(result);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_0);
+Datum wasm_invoke_function_0(PG_FUNCTION_ARGS)
+{
+    return wasm_invoke_function_args(fcinfo, NULL, 0);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_1);
+Datum wasm_invoke_function_1(PG_FUNCTION_ARGS)
+{
+    int64 params[1];
+
+    params[0] = PG_GETARG_INT64(2);
+    return wasm_invoke_function_args(fcinfo, params, 1);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_2);
+Datum wasm_invoke_function_2(PG_FUNCTION_ARGS)
+{
+    int64 params[2];
+
+    params[0] = PG_GETARG_INT64(2);
+    params[1] = PG_GETARG_INT64(3);
+    return wasm_invoke_function_args(fcinfo, params, 2);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_3);
+Datum wasm_invoke_function_3(PG_FUNCTION_ARGS)
+{
+    int64 params[3];
+
+    params[0] = PG_GETARG_INT64(2);
+    params[1] = PG_GETARG_INT64(3);
+    params[2] = PG_GETARG_INT64(4);
+    return wasm_invoke_function_args(fcinfo, params, 3);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_4);
+Datum wasm_invoke_function_4(PG_FUNCTION_ARGS)
+{
+    int64 params[4];
+
+    params[0] = PG_GETARG_INT64(2);
+    params[1] = PG_GETARG_INT64(3);
+    params[2] = PG_GETARG_INT64(4);
+    params[3] = PG_GETARG_INT64(5);
+    return wasm_invoke_function_args(fcinfo, params, 4);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_5);
+Datum wasm_invoke_function_5(PG_FUNCTION_ARGS)
+{
+    int64 params[5];
+
+    params[0] = PG_GETARG_INT64(2);
+    params[1] = PG_GETARG_INT64(3);
+    params[2] = PG_GETARG_INT64(4);
+    params[3] = PG_GETARG_INT64(5);
+    params[4] = PG_GETARG_INT64(6);
+    return wasm_invoke_function_args(fcinfo, params, 5);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_6);
+Datum wasm_invoke_function_6(PG_FUNCTION_ARGS)
+{
+    int64 params[6];
+
+    params[0] = PG_GETARG_INT64(2);
+    params[1] = PG_GETARG_INT64(3);
+    params[2] = PG_GETARG_INT64(4);
+    params[3] = PG_GETARG_INT64(5);
+    params[4] = PG_GETARG_INT64(6);
+    params[5] = PG_GETARG_INT64(7);
+    return wasm_invoke_function_args(fcinfo, params, 6);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_7);
+Datum wasm_invoke_function_7(PG_FUNCTION_ARGS)
+{
+    int64 params[7];
+
+    params[0] = PG_GETARG_INT64(2);
+    params[1] = PG_GETARG_INT64(3);
+    params[2] = PG_GETARG_INT64(4);
+    params[3] = PG_GETARG_INT64(5);
+    params[4] = PG_GETARG_INT64(6);
+    params[5] = PG_GETARG_INT64(7);
+    params[6] = PG_GETARG_INT64(8);
+    return wasm_invoke_function_args(fcinfo, params, 7);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_8);
+Datum wasm_invoke_function_8(PG_FUNCTION_ARGS)
+{
+    int64 params[8];
+
+    params[0] = PG_GETARG_INT64(2);
+    params[1] = PG_GETARG_INT64(3);
+    params[2] = PG_GETARG_INT64(4);
+    params[3] = PG_GETARG_INT64(5);
+    params[4] = PG_GETARG_INT64(6);
+    params[5] = PG_GETARG_INT64(7);
+    params[6] = PG_GETARG_INT64(8);
+    params[7] = PG_GETARG_INT64(9);
+    return wasm_invoke_function_args(fcinfo, params, 8);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_9);
+Datum wasm_invoke_function_9(PG_FUNCTION_ARGS)
+{
+    int64 params[9];
+
+    params[0] = PG_GETARG_INT64(2);
+    params[1] = PG_GETARG_INT64(3);
+    params[2] = PG_GETARG_INT64(4);
+    params[3] = PG_GETARG_INT64(5);
+    params[4] = PG_GETARG_INT64(6);
+    params[5] = PG_GETARG_INT64(7);
+    params[6] = PG_GETARG_INT64(8);
+    params[7] = PG_GETARG_INT64(9);
+    params[8] = PG_GETARG_INT64(10);
+    return wasm_invoke_function_args(fcinfo, params, 9);
+}
+
+PG_FUNCTION_INFO_V1(wasm_invoke_function_10);
+Datum wasm_invoke_function_10(PG_FUNCTION_ARGS)
+{
+    int64 params[10];
+
+    params[0] = PG_GETARG_INT64(2);
+    params[1] = PG_GETARG_INT64(3);
+    params[2] = PG_GETARG_INT64(4);
+    params[3] = PG_GETARG_INT64(5);
+    params[4] = PG_GETARG_INT64(6);
+    params[5] = PG_GETARG_INT64(7);
+    params[6] = PG_GETARG_INT64(8);
+    params[7] = PG_GETARG_INT64(9);
+    params[8] = PG_GETARG_INT64(10);
+    params[9] = PG_GETARG_INT64(11);
+    return wasm_invoke_function_args(fcinfo, params, 10);
+}
+
+/*
+ * wasm_invoke_batch(instanceid, funcname, int8[] [, int8[] ...]) runs a batch
+ * export once over all rows of the argument arrays and returns the results as
+ * int8[]. See wasm_call_batch for the guest side of the call.
+ */
+PG_FUNCTION_INFO_V1(wasm_invoke_batch);
+Datum wasm_invoke_batch(PG_FUNCTION_ARGS)
+{
+    WasmInvokeCache *cache = wasm_invoke_cache_lookup(fcinfo);
+
+    int ncols = PG_NARGS() - 2;
+    WasmBatchColumn columns[FUNC_MAX_ARGS];
+    int nrows = -1;
+    for (int i = 0; i < ncols; i++) {
+        ArrayType *array = PG_GETARG_ARRAYTYPE_P(i + 2);
+        nrows = wasm_batch_array_items(array, nrows, false);
+        columns[i].data = ARR_DATA_PTR(array);
+        columns[i].width = sizeof(int64);
+    }
+
+    ArrayType *result = wasm_alloc_array(INT8OID, sizeof(int64), nrows);
+    wasm_call_batch(cache->instinfo, cache->funcinfo, columns, ncols, nrows, ARR_DATA_PTR(result), sizeof(int64),
+        NULL);
+    PG_RETURN_ARRAYTYPE_P(result);
+}
+
+/*
+ * Totals of one export over all threads, as returned by wasm_stat_functions.
+ */
+typedef struct WasmFuncStatRow {
+    int64 instanceid;
+    char *wasm_file;
+    char *funcname;
+    uint64 calls;
+    uint64 traps;
+    uint64 total_ns;
+    uint64 self_ns;
+    uint64 bytes_in;
+    uint64 bytes_out;
+    uint64 memo_hits;
+    uint64 memo_misses;
+    uint64 sampled_calls;
+    uint64 sampled_ns;
+    uint64 sampled_guest_ns;
+    uint64 latency[WASM_STAT_BUCKETS];
+} WasmFuncStatRow;
+
+typedef struct TupleFuncStatState {
+    TupleDesc tupd;
+    WasmFuncStatRow *rows;
+} TupleFuncStatState;
+
+/*
+ * Sum the statistics slots of all threads by export. Slots of modules which
+ * were dropped or replaced in the meantime are skipped.
+ */
+static int wasm_stat_collect(WasmFuncStatRow **rows)
+{
+    std::vector<std::shared_ptr<WasmStatSlot>> slots;
+    {
+        std::lock_guard<std::mutex> guard(wasm_stat_lock);
+        slots = wasm_stat_slots;
+    }
+    std::shared_ptr<const WasmModuleMap> modules = std::atomic_load(&wasm_modules);
+
+    std::map<std::pair<int64, int>, WasmFuncStatRow> totals;
+    for (const std::shared_ptr<WasmStatSlot> &slot : slots) {
+        WasmModuleMap::const_iterator moditor = modules->find(slot->module->id);
+        if (moditor == modules->end() || moditor->second != slot->module) {
+            continue;
+        }
+        for (WasmFuncInfo *funcinfo : slot->module->functions) {
+            WasmFuncStats *stats = &slot->funcs[funcinfo->index];
+            WasmFuncStatRow &row = totals[std::make_pair(slot->module->id, funcinfo->index)];
+            row.calls += stats->calls.load(std::memory_order_relaxed);
+            row.traps += stats->traps.load(std::memory_order_relaxed);
+            row.total_ns += stats->total_ns.load(std::memory_order_relaxed);
+            row.self_ns += stats->self_ns.load(std::memory_order_relaxed);
+            row.bytes_in += stats->bytes_in.load(std::memory_order_relaxed);
+            row.bytes_out += stats->bytes_out.load(std::memory_order_relaxed);
+            row.memo_hits += stats->memo_hits.load(std::memory_order_relaxed);
+            row.memo_misses += stats->memo_misses.load(std::memory_order_relaxed);
+            row.sampled_calls += stats->sampled_calls.load(std::memory_order_relaxed);
+            row.sampled_ns += stats->sampled_ns.load(std::memory_order_relaxed);
+            row.sampled_guest_ns += stats->sampled_guest_ns.load(std::memory_order_relaxed);
+            for (int i = 0; i < WASM_STAT_BUCKETS; i++) {
+                row.latency[i] += stats->latency[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    int nrows = 0;
+    *rows = (WasmFuncStatRow*)palloc0(sizeof(WasmFuncStatRow) * (totals.size() + 1));
+    for (std::pair<const std::pair<int64, int>, WasmFuncStatRow> &entry : totals) {
+        WasmModuleInfo *module = modules->find(entry.first.first)->second.get();
+        WasmFuncStatRow *row = &(*rows)[nrows++];
+        *row = entry.second;
+        row->instanceid = entry.first.first;
+        row->wasm_file = pstrdup(module->wasm_file.c_str());
+        row->funcname = pstrdup(module->functions[entry.first.second]->funcname.c_str());
+    }
+    return nrows;
+}
+
+PG_FUNCTION_INFO_V1(wasm_stat_functions);
+Datum wasm_stat_functions(PG_FUNCTION_ARGS)
+{
+    FuncCallContext* fctx = NULL;
+    TupleFuncStatState* inter_call_data = NULL;
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+        MemoryContext mctx;
+
+        fctx = SRF_FIRSTCALL_INIT();
+        mctx = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+        inter_call_data = (TupleFuncStatState*)palloc(sizeof(TupleFuncStatState));
+
+        /* Build a tuple descriptor for our result type */
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            elog(ERROR, "wasm_executor: return type must be a row type");
+
+        inter_call_data->tupd = tupdesc;
+        fctx->max_calls = wasm_stat_collect(&inter_call_data->rows);
+        fctx->user_fctx = inter_call_data;
+        MemoryContextSwitchTo(mctx);
+    }
+
+    fctx = SRF_PERCALL_SETUP();
+    inter_call_data = (TupleFuncStatState*)(fctx->user_fctx);
+
+    if (fctx->call_cntr < fctx->max_calls) {
+        WasmFuncStatRow *row = &inter_call_data->rows[fctx->call_cntr];
+        Datum values[11];
+        bool nulls[11];
+        Datum latency[WASM_STAT_BUCKETS];
+
+        errno_t rc = memset_s(nulls, sizeof(nulls), 0, sizeof(nulls));
+        securec_check_c(rc, "\0", "\0");
+
+        for (int i = 0; i < WASM_STAT_BUCKETS; i++) {
+            latency[i] = Int64GetDatum((int64)row->latency[i]);
+        }
+        values[0] = Int64GetDatum(row->instanceid);
+        values[1] = CStringGetTextDatum(row->funcname);
+        values[2] = Int64GetDatum((int64)row->calls);
+        values[3] = Int64GetDatum((int64)row->traps);
+        values[4] = Float8GetDatum(row->total_ns / 1000000.0);
+        values[5] = Float8GetDatum(row->self_ns / 1000000.0);
+        values[6] = Int64GetDatum((int64)row->bytes_in);
+        values[7] = Int64GetDatum((int64)row->bytes_out);
+        values[8] = Int64GetDatum((int64)row->memo_hits);
+        values[9] = Int64GetDatum((int64)row->memo_misses);
+        values[10] = PointerGetDatum(construct_array(latency, WASM_STAT_BUCKETS, INT8OID, sizeof(int64),
+            FLOAT8PASSBYVAL, 'd'));
+
+        /* Build and return the result tuple. */
+        HeapTuple resultTuple = heap_form_tuple(inter_call_data->tupd, values, nulls);
+        SRF_RETURN_NEXT(fctx, HeapTupleGetDatum(resultTuple));
+    } else {
+        SRF_RETURN_DONE(fctx);
+    }
+}
+
+PG_FUNCTION_INFO_V1(wasm_stat_modules);
+Datum wasm_stat_modules(PG_FUNCTION_ARGS)
+{
+    FuncCallContext* fctx = NULL;
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+        MemoryContext mctx;
+
+        fctx = SRF_FIRSTCALL_INIT();
         mctx = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
-        inter_call_data = (TupleInstanceState*)palloc(sizeof(TupleInstanceState));
 
-        /* Build a tuple descriptor for our result type */
-        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-            elog(ERROR, "wasm_executor: return type must be a row type");
+        /* Build a tuple descriptor for our result type */
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            elog(ERROR, "wasm_executor: return type must be a row type");
+
+        // Form all tuples now, the registry may change between calls
+        std::shared_ptr<const WasmModuleMap> modules = std::atomic_load(&wasm_modules);
+        // Running instances and their linear memory, summed over threads
+        std::map<WasmModuleInfo*, std::pair<int64, int64>> usage;
+        {
+            std::lock_guard<std::mutex> guard(wasm_stat_lock);
+            for (const std::shared_ptr<WasmStatSlot> &slot : wasm_stat_slots) {
+                if (slot->running.load(std::memory_order_relaxed)) {
+                    std::pair<int64, int64> &entry = usage[slot->module.get()];
+                    entry.first++;
+                    entry.second += (int64)slot->memory_bytes.load(std::memory_order_relaxed);
+                }
+            }
+        }
+        HeapTuple *tuples = (HeapTuple*)palloc(sizeof(HeapTuple) * (modules->size() + 1));
+        int nmodules = 0;
+        for (const WasmModuleMap::value_type &entry : *modules) {
+            WasmModuleInfo *module = entry.second.get();
+            Datum values[13];
+            bool nulls[13];
+            errno_t rc = memset_s(nulls, sizeof(nulls), 0, sizeof(nulls));
+            securec_check_c(rc, "\0", "\0");
+
+            values[0] = Int64GetDatum(module->id);
+            values[1] = CStringGetTextDatum(module->wasm_file.c_str());
+            values[2] = Int64GetDatum(module->version);
+            values[3] = Float8GetDatum(module->compile_ns / 1000000.0);
+            values[4] = BoolGetDatum(module->compiled_from_cache);
+            values[5] = Int64GetDatum((int64)module->instantiations.load(std::memory_order_relaxed));
+            values[6] = Float8GetDatum(module->instantiate_ns.load(std::memory_order_relaxed) / 1000000.0);
+            int tier_up = module->tier_up.load(std::memory_order_acquire);
+            // Only modules compiled in tiers ever leave WASM_TIER_UP_NONE
+            values[7] = CStringGetTextDatum((tier_up == WASM_TIER_UP_NONE || tier_up == WASM_TIER_UP_DONE) ?
+                "optimized" : "baseline");
+            nulls[8] = (tier_up == WASM_TIER_UP_NONE);
+            values[8] = CStringGetTextDatum(tier_up == WASM_TIER_UP_COMPILING ? "compiling" :
+                (tier_up == WASM_TIER_UP_DONE ? "done" : "failed"));
+            nulls[9] = (tier_up != WASM_TIER_UP_DONE);
+            values[9] = Float8GetDatum(module->tier_up_ns / 1000000.0);
+            std::pair<int64, int64> running = usage[module];
+            values[10] = Int64GetDatum(running.first);
+            values[11] = Int64GetDatum(running.second);
+            values[12] = Int64GetDatum((int64)module->evictions.load(std::memory_order_relaxed));
+            tuples[nmodules++] = heap_form_tuple(tupdesc, values, nulls);
+        }
+        fctx->max_calls = nmodules;
+        fctx->user_fctx = tuples;
+        MemoryContextSwitchTo(mctx);
+    }
+
+    fctx = SRF_PERCALL_SETUP();
+    if (fctx->call_cntr < fctx->max_calls) {
+        HeapTuple *tuples = (HeapTuple*)fctx->user_fctx;
+        SRF_RETURN_NEXT(fctx, HeapTupleGetDatum(tuples[fctx->call_cntr]));
+    } else {
+        SRF_RETURN_DONE(fctx);
+    }
+}
+
+/*
+ * Frame names may not contain the separators of the folded stack format.
+ */
+static std::string wasm_profile_frame(const char *name)
+{
+    std::string frame(name);
+    std::replace(frame.begin(), frame.end(), ';', '_');
+    std::replace(frame.begin(), frame.end(), ' ', '_');
+    return frame;
+}
+
+/*
+ * Write the calls sampled by wasm.profile_sample_rate so far as folded stacks,
+ * one module;export;guest and one module;export;host line per export weighted
+ * by nanoseconds, which flamegraph.pl and most flame graph viewers read.
+ * Returns the path of the file, under the data directory.
+ */
+PG_FUNCTION_INFO_V1(wasm_profile_dump);
+Datum wasm_profile_dump(PG_FUNCTION_ARGS)
+{
+    if (!superuser())
+        ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE), (errmsg("wasm_executor: must be system admin to dump wasm profiles"))));
+
+    WasmFuncStatRow *rows = NULL;
+    int nrows = wasm_stat_collect(&rows);
+
+    std::string dir = std::string(t_thrd.proc_cxt.DataDir) + "/" + WASM_PROFILE_DIR;
+    if (mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+        ereport(ERROR, (errcode_for_file_access(),
+            errmsg("wasm_executor: could not create directory \"%s\": %m", dir.c_str())));
+    }
+    std::string path = dir + "/" + std::to_string((long)time(NULL)) + "_" +
+        std::to_string((unsigned long)pthread_self()) + ".folded";
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == NULL) {
+        ereport(ERROR, (errcode_for_file_access(),
+            errmsg("wasm_executor: could not open file \"%s\": %m", path.c_str())));
+    }
+    for (int i = 0; i < nrows; i++) {
+        WasmFuncStatRow *row = &rows[i];
+        if (row->sampled_calls == 0) {
+            continue;
+        }
+        std::string stack = wasm_profile_frame(row->wasm_file) + ";" + wasm_profile_frame(row->funcname);
+        uint64 guest_ns = Min(row->sampled_guest_ns, row->sampled_ns);
+        fprintf(file, "%s;guest %lu\n", stack.c_str(), guest_ns);
+        fprintf(file, "%s;host %lu\n", stack.c_str(), row->sampled_ns - guest_ns);
+    }
+    bool ok = (ferror(file) == 0);
+    ok = (fclose(file) == 0) && ok;
+    if (!ok) {
+        ereport(ERROR, (errcode_for_file_access(),
+            errmsg("wasm_executor: could not write file \"%s\": %m", path.c_str())));
+    }
+    PG_RETURN_TEXT_P(cstring_to_text(path.c_str()));
+}
+
+static const char* wasm_enum_name(const struct config_enum_entry *options, int value)
+{
+    for (const struct config_enum_entry *option = options; option->name != NULL; option++) {
+        if (option->val == value) {
+            return option->name;
+        }
+    }
+    return "";
+}
+
+/*
+ * Effective settings of the engine, which is created first if needed.
+ */
+PG_FUNCTION_INFO_V1(wasm_engine_config);
+Datum wasm_engine_config(PG_FUNCTION_ARGS)
+{
+    FuncCallContext* fctx = NULL;
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+        MemoryContext mctx;
+
+        fctx = SRF_FIRSTCALL_INIT();
+        mctx = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+
+        /* Build a tuple descriptor for our result type */
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            elog(ERROR, "wasm_executor: return type must be a row type");
+
+        (void)wasm_get_engine();
+        const WasmEngineSettings &settings = wasm_engine_settings;
+        const std::pair<const char*, std::string> rows[] = {
+            {"engine_version", WASM_ENGINE_VERSION},
+            {"compiler", "cranelift"},
+            {"opt_level", wasm_enum_name(wasm_opt_level_options, settings.opt_level)},
+            {"parallel_compilation", settings.parallel_compilation ? "on" : "off"},
+            {"simd", settings.simd ? "on" : "off"},
+            {"bulk_memory", settings.bulk_memory ? "on" : "off"},
+            {"static_memory_maximum_size", std::to_string(settings.static_memory_maximum_size) + "kB"},
+            {"static_memory_guard_size", std::to_string(settings.static_memory_guard_size) + "kB"},
+            {"dynamic_memory_guard_size", std::to_string(settings.dynamic_memory_guard_size) + "kB"},
+            {"epoch_interruption", "on"},
+            {"fuel_metering", settings.fuel ? "on" : "off"},
+            {"profiler", wasm_enum_name(wasm_profiler_options, settings.profiler)},
+        };
+
+        HeapTuple *tuples = (HeapTuple*)palloc(sizeof(HeapTuple) * lengthof(rows));
+        for (size_t i = 0; i < lengthof(rows); i++) {
+            Datum values[2];
+            bool nulls[2] = {false, false};
+            values[0] = CStringGetTextDatum(rows[i].first);
+            values[1] = CStringGetTextDatum(rows[i].second.c_str());
+            tuples[i] = heap_form_tuple(tupdesc, values, nulls);
+        }
+        fctx->max_calls = lengthof(rows);
+        fctx->user_fctx = tuples;
+        MemoryContextSwitchTo(mctx);
+    }
+
+    fctx = SRF_PERCALL_SETUP();
+    if (fctx->call_cntr < fctx->max_calls) {
+        HeapTuple *tuples = (HeapTuple*)fctx->user_fctx;
+        SRF_RETURN_NEXT(fctx, HeapTupleGetDatum(tuples[fctx->call_cntr]));
+    } else {
+        SRF_RETURN_DONE(fctx);
+    }
+}
+
+/*
+ * Split the prosrc of a LANGUAGE wasm function, which has the form
+ * 'module:export'. The module part is either an instance id or the path the
+ * instance was created from.
+ */
+static void wasm_parse_prosrc(const char *prosrc, int64 *instanceid, std::string &funcname)
+{
+    const char *sep = strrchr(prosrc, ':');
+    if (sep == NULL || sep == prosrc || *(sep + 1) == '\0') {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_FUNCTION_DEFINITION),
+            errmsg("wasm_executor: invalid function body \"%s\"", prosrc),
+            errhint("The body of a wasm function must be 'module:export'.")));
+    }
+
+    std::string module(prosrc, sep - prosrc);
+    funcname = std::string(sep + 1);
+
+    if (strspn(module.c_str(), "-0123456789") == module.length()) {
+        *instanceid = atol(module.c_str());
+    } else {
+        char *filepath = pstrdup(module.c_str());
+        canonicalize_path(filepath);
+        *instanceid = generate_uuid(CStringGetTextDatum(filepath));
+        pfree(filepath);
+    }
+}
+
+static inline bool wasm_is_varlena_type(Oid typid)
+{
+    return typid == BYTEAOID || typid == TEXTOID;
+}
+
+/*
+ * Wasm value kind a SQL type is passed as: integer and boolean as i32, bigint
+ * and timestamps as i64, real as f32 and double precision as f64. bytea and
+ * text results are an i64 holding (ptr << 32 | len).
+ */
+static bool wasm_type_valkind(Oid typid, wasm_valkind_t *kind)
+{
+    switch (typid) {
+        case INT4OID:
+        case BOOLOID:
+            *kind = WASM_I32;
+            return true;
+        case INT8OID:
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+        case BYTEAOID:
+        case TEXTOID:
+            *kind = WASM_I64;
+            return true;
+        case FLOAT4OID:
+            *kind = WASM_F32;
+            return true;
+        case FLOAT8OID:
+            *kind = WASM_F64;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline int wasm_valkind_size(wasm_valkind_t kind)
+{
+    return (kind == WASM_I32 || kind == WASM_F32) ? sizeof(int32) : sizeof(int64);
+}
+
+/*
+ * Whether a value of typid can be passed as or returned from kind. integer
+ * and bigint are converted between i32 and i64.
+ */
+static bool wasm_type_accepts(Oid typid, wasm_valkind_t kind)
+{
+    wasm_valkind_t natural;
+    if (!wasm_type_valkind(typid, &natural)) {
+        return false;
+    }
+    if (typid == INT4OID || typid == INT8OID) {
+        return kind == WASM_I32 || kind == WASM_I64;
+    }
+    return kind == natural;
+}
+
+/*
+ * Width in linear memory of the array elements of batch calls and the input
+ * columns of aggregates, or 0 if typid cannot be one. Values keep their SQL
+ * layout there, so boolean with its one-byte elements is left out.
+ */
+static int wasm_column_width(Oid typid)
+{
+    wasm_valkind_t kind;
+    if (typid == BOOLOID || wasm_is_varlena_type(typid) || !wasm_type_valkind(typid, &kind)) {
+        return 0;
+    }
+    return wasm_valkind_size(kind);
+}
+
+/*
+ * Width of the result elements of a batch call, as wasm_column_width, except
+ * that boolean[] is allowed with its one-byte elements, one per row.
+ */
+static int wasm_batch_result_width(Oid typid)
+{
+    return (typid == BOOLOID) ? sizeof(bool) : wasm_column_width(typid);
+}
+
+/*
+ * Convert a fixed-width Datum straight into a wasm value of kind, as accepted
+ * by wasm_type_accepts.
+ */
+static inline void wasm_datum_to_raw(Datum value, Oid typid, wasm_valkind_t kind, wasmtime_val_raw_t *raw)
+{
+    int64 integer;
+    switch (typid) {
+        case FLOAT4OID:
+            raw->f32 = DatumGetFloat4(value);
+            return;
+        case FLOAT8OID:
+            raw->f64 = DatumGetFloat8(value);
+            return;
+        case INT4OID:
+            integer = DatumGetInt32(value);
+            break;
+        case BOOLOID:
+            integer = DatumGetBool(value) ? 1 : 0;
+            break;
+        default:
+            integer = DatumGetInt64(value);
+            break;
+    }
+    if (kind == WASM_I32) {
+        raw->i32 = (int32)integer;
+    } else {
+        raw->i64 = integer;
+    }
+}
+
+static inline Datum wasm_raw_to_datum(Oid typid, wasm_valkind_t kind, const wasmtime_val_raw_t *raw)
+{
+    int64 integer = (kind == WASM_I32) ? raw->i32 : raw->i64;
+    switch (typid) {
+        case FLOAT4OID:
+            return Float4GetDatum(raw->f32);
+        case FLOAT8OID:
+            return Float8GetDatum(raw->f64);
+        case INT4OID:
+            return Int32GetDatum((int32)integer);
+        case BOOLOID:
+            return BoolGetDatum(integer != 0);
+        case TIMESTAMPOID:
+            return TimestampGetDatum(integer);
+        case TIMESTAMPTZOID:
+            return TimestampTzGetDatum(integer);
+        default:
+            return Int64GetDatum(integer);
+    }
+}
+
+static void wasm_check_result_type(Oid rettype, wasm_valkind_t kind, const char *proname)
+{
+    if (!wasm_type_accepts(rettype, kind)) {
+        ereport(ERROR, (errmsg("wasm_executor: not support the return type(%u) for function %s",
+            rettype, proname)));
+    }
+}
+
+/*
+ * Width of an attribute in a packed row, or 0 if its type cannot be packed.
+ */
+static int wasm_row_attr_width(Oid typid)
+{
+    wasm_valkind_t kind;
+    if (!wasm_type_valkind(typid, &kind)) {
+        return 0;
+    }
+    // bytea and text take an (i32 ptr, i32 len) pair
+    return wasm_is_varlena_type(typid) ? 2 * sizeof(int32) : wasm_valkind_size(kind);
+}
+
+static void wasm_check_row_attrs(TupleDesc tupdesc, const char *proname)
+{
+    for (int i = 0; i < tupdesc->natts; i++) {
+        Form_pg_attribute attr = tupdesc->attrs[i];
+        if (!attr->attisdropped && wasm_row_attr_width(attr->atttypid) == 0) {
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("wasm_executor: attribute \"%s\" of type %s cannot be passed to function %s",
+                    NameStr(attr->attname), format_type_be(attr->atttypid), proname)));
+        }
+    }
+}
+
+/*
+ * Map the SQL arguments of a scalar wasm function onto the parameters of the
+ * export. Fixed-width types take one parameter of the kind given by
+ * wasm_type_valkind, bytea, text and rows take an (i32 ptr, i32 len) pair
+ * pointing into linear memory.
+ */
+static void wasm_call_cache_bind_args(WasmCallCache *cache, WasmFuncInfo *funcinfo, const char *proname)
+{
+    size_t slot = 0;
+    cache->has_buffers = false;
+    for (int i = 0; i < cache->nargs; i++) {
+        Oid argtype = cache->argtypes[i];
+        bool buffer = wasm_is_varlena_type(argtype) || cache->rowargs[i];
+        cache->argslots[i] = slot;
+        if (buffer && slot + 1 < funcinfo->params.size() &&
+            funcinfo->params[slot] == WASM_I32 && funcinfo->params[slot + 1] == WASM_I32) {
+            cache->has_buffers = true;
+            slot += 2;
+        } else if (!buffer && slot < funcinfo->params.size() &&
+            wasm_type_accepts(argtype, funcinfo->params[slot])) {
+            slot += 1;
+        } else {
+            ereport(ERROR, (errmsg("wasm_executor: not support the argument type(%u) for function %s",
+                argtype, proname)));
+        }
+        // The attributes of a record are only known per call
+        if (cache->rowargs[i] && argtype != RECORDOID) {
+            TupleDesc tupdesc = lookup_rowtype_tupdesc(argtype, -1);
+            wasm_check_row_attrs(tupdesc, proname);
+            ReleaseTupleDesc(tupdesc);
+        }
+    }
+    if (slot != funcinfo->params.size()) {
+        ereport(ERROR, (errmsg("wasm_executor: signature of function %s does not match the export %s",
+            proname, funcinfo->funcname.c_str())));
+    }
+}
+
+static void wasm_check_result_count(WasmFuncInfo *funcinfo, size_t nresults, const char *proname)
+{
+    if (funcinfo->results.size() != nresults) {
+        ereport(ERROR, (errmsg("wasm_executor: signature of function %s does not match the export %s",
+            proname, funcinfo->funcname.c_str())));
+    }
+}
+
+/*
+ * Resolve and bless the row type of a composite or set-returning function. A
+ * set of a scalar type is treated as a row of one column.
+ */
+static void wasm_call_cache_bind_rowtype(FunctionCallInfo fcinfo, WasmCallCache *cache, WasmFuncInfo *funcinfo,
+    const char *proname)
+{
+    TupleDesc tupdesc = NULL;
+    Oid resulttype = InvalidOid;
+    TypeFuncClass typeclass = get_call_result_type(fcinfo, &resulttype, &tupdesc);
+
+    MemoryContext oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+    if (typeclass == TYPEFUNC_COMPOSITE) {
+        tupdesc = CreateTupleDescCopy(tupdesc);
+    } else if (typeclass == TYPEFUNC_SCALAR && cache->mode == WASM_CALL_SRF) {
+        tupdesc = CreateTemplateTupleDesc(1, false);
+        TupleDescInitEntry(tupdesc, (AttrNumber)1, proname, resulttype, -1, 0);
+    } else {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+            errmsg("wasm_executor: function %s returning record called in context that cannot accept type record",
+                proname)));
+    }
+    cache->tupdesc = BlessTupleDesc(tupdesc);
+    MemoryContextSwitchTo(oldcontext);
+
+    int ncolumns = 0;
+    cache->rowwidth = 0;
+    for (int i = 0; i < tupdesc->natts; i++) {
+        if (tupdesc->attrs[i]->attisdropped) {
+            continue;
+        }
+        Oid coltype = tupdesc->attrs[i]->atttypid;
+        wasm_valkind_t kind;
+        if (cache->mode == WASM_CALL_COMPOSITE) {
+            if ((size_t)ncolumns < funcinfo->results.size()) {
+                wasm_check_result_type(coltype, funcinfo->results[ncolumns], proname);
+            }
+        } else if (wasm_type_valkind(coltype, &kind)) {
+            cache->rowwidth += wasm_valkind_size(kind);
+        } else {
+            ereport(ERROR, (errmsg("wasm_executor: not support the return type(%u) for function %s",
+                coltype, proname)));
+        }
+        ncolumns++;
+    }
+
+    if (cache->mode == WASM_CALL_COMPOSITE) {
+        wasm_check_result_count(funcinfo, ncolumns, proname);
+    } else {
+        // One i64 holding the row buffer in the high and the row count in the low 32 bits
+        wasm_check_result_count(funcinfo, 1, proname);
+        if (funcinfo->results[0] != WASM_I64) {
+            ereport(ERROR, (errmsg("wasm_executor: export %s of set-returning function %s must return i64",
+                funcinfo->funcname.c_str(), proname)));
+        }
+    }
+}
+
+/*
+ * Check that a batch export takes (in_ptr i32, nrows i32, out_ptr i32), or
+ * (in_ptr i32, nulls_ptr i32, nrows i32, out_ptr i32) to get null flags.
+ */
+static void wasm_call_cache_bind_batch(WasmCallCache *cache, WasmFuncInfo *funcinfo, const char *proname)
+{
+    static const wasm_valkind_t batch_params[] = {WASM_I32, WASM_I32, WASM_I32, WASM_I32};
+    size_t nparams = funcinfo->params.size();
+    if ((nparams != 3 && nparams != 4) ||
+        !std::equal(batch_params, batch_params + nparams, funcinfo->params.begin())) {
+        ereport(ERROR, (errmsg("wasm_executor: batch export %s of function %s must take (in_ptr i32, nrows i32, "
+            "out_ptr i32) or (in_ptr i32, nulls_ptr i32, nrows i32, out_ptr i32)",
+            funcinfo->funcname.c_str(), proname)));
+    }
+    cache->batch_nulls = (nparams == 4);
+}
+
+static WasmCallMode wasm_call_mode(WasmCallCache *cache)
+{
+    if (cache->retset) {
+        return WASM_CALL_SRF;
+    }
+    if (type_is_rowtype(cache->rettype)) {
+        return WASM_CALL_COMPOSITE;
+    }
+
+    /*
+     * A function over integer[]/bigint[] arguments returning an array is bound
+     * to a batch export, which handles all elements with one guest call.
+     */
+    bool batch = (wasm_batch_result_width(cache->retelemtype) > 0);
+    for (int i = 0; i < cache->nargs; i++) {
+        batch = batch && (wasm_column_width(cache->elemtypes[i]) > 0);
+    }
+    if (batch) {
+        return WASM_CALL_BATCH;
+    }
+
+    // Aggregate support functions take and return their state as internal
+    if (cache->nargs >= 1 && cache->argtypes[0] == INTERNALOID) {
+        if (cache->rettype != INTERNALOID) {
+            return WASM_CALL_AGG_FINAL;
+        }
+        return WASM_CALL_AGG_TRANS;
+    }
+    return WASM_CALL_SCALAR;
+}
+
+static WasmFuncInfo* wasm_agg_find_func(WasmModuleInfo *module, const std::string &prefix, const char *suffix,
+    bool missing_ok)
+{
+    std::string name = prefix + suffix;
+    std::unordered_map<std::string, WasmFuncInfo*>::iterator itor = module->function_index.find(name);
+    if (itor == module->function_index.end()) {
+        if (!missing_ok) {
+            ereport(ERROR, (errmsg("wasm_executor: aggregate export %s is missing", name.c_str())));
+        }
+        return NULL;
+    }
+    return itor->second;
+}
+
+static void wasm_agg_check_func(WasmFuncInfo *funcinfo, const wasm_valkind_t *params, size_t nparams,
+    const wasm_valkind_t *results, size_t nresults)
+{
+    if (funcinfo != NULL && !wasm_signature_equals(funcinfo, params, nparams, results, nresults)) {
+        ereport(ERROR, (errmsg("wasm_executor: signature of aggregate export %s does not match",
+            funcinfo->funcname.c_str())));
+    }
+}
+
+/*
+ * Resolve the exports of an aggregate whose support functions are declared
+ * with the body 'module:prefix'. Every support function binds all of them, as
+ * the final function also flushes the rows buffered so far.
+ */
+static void wasm_agg_bind_funcs(WasmCallCache *cache, WasmModuleInfo *module, const std::string &prefix,
+    const char *proname)
+{
+    static const wasm_valkind_t i32x3[] = {WASM_I32, WASM_I32, WASM_I32};
+
+    cache->agg.init = wasm_agg_find_func(module, prefix, WASM_AGG_INIT_SUFFIX, false);
+    cache->agg.step = wasm_agg_find_func(module, prefix, WASM_AGG_STEP_SUFFIX, false);
+    cache->agg.final = wasm_agg_find_func(module, prefix, WASM_AGG_FINAL_SUFFIX, false);
+    cache->agg.free = wasm_agg_find_func(module, prefix, WASM_AGG_FREE_SUFFIX, true);
+
+    // init() -> state, step(state, in_ptr, nrows), free(state)
+    wasm_agg_check_func(cache->agg.init, NULL, 0, i32x3, 1);
+    wasm_agg_check_func(cache->agg.step, i32x3, 3, NULL, 0);
+    wasm_agg_check_func(cache->agg.free, i32x3, 1, NULL, 0);
+
+    if (cache->mode == WASM_CALL_AGG_TRANS) {
+        for (int i = 1; i < cache->nargs; i++) {
+            if (cache->argtypes[i] == INTERNALOID) {
+                ereport(ERROR, (errmsg("wasm_executor: combine function %s is not supported", proname),
+                    errhint("States live in the linear memory of one instance, declare the aggregate "
+                        "PARALLEL RESTRICTED without a combine function.")));
+            }
+            if (wasm_column_width(cache->argtypes[i]) == 0) {
+                ereport(ERROR, (errmsg("wasm_executor: not support the argument type(%u) for aggregate function %s",
+                    cache->argtypes[i], proname)));
+            }
+        }
+    }
+    if (cache->mode == WASM_CALL_AGG_FINAL) {
+        WasmFuncInfo *final = cache->agg.final;
+        if (final->params.size() != 1 || final->params[0] != WASM_I32 || final->results.size() != 1) {
+            ereport(ERROR, (errmsg("wasm_executor: signature of aggregate export %s does not match",
+                final->funcname.c_str())));
+        }
+        wasm_check_result_type(cache->rettype, final->results[0], proname);
+    }
+}
+
+static WasmCallCache* wasm_call_cache_init(FunctionCallInfo fcinfo)
+{
+    FmgrInfo *flinfo = fcinfo->flinfo;
+    HeapTuple proctup = SearchSysCache1(PROCOID, ObjectIdGetDatum(flinfo->fn_oid));
+    if (!HeapTupleIsValid(proctup)) {
+        ereport(ERROR, (errmsg("wasm_executor: cache lookup failed for function %u", flinfo->fn_oid)));
+    }
+    Form_pg_proc procform = (Form_pg_proc)GETSTRUCT(proctup);
+
+    bool isnull = false;
+    Datum prosrcdatum = SysCacheGetAttr(PROCOID, proctup, Anum_pg_proc_prosrc, &isnull);
+    if (isnull) {
+        ereport(ERROR, (errmsg("wasm_executor: null prosrc for function %u", flinfo->fn_oid)));
+    }
+    char *prosrc = TextDatumGetCString(prosrcdatum);
+
+    int64 instanceid = 0;
+    std::string funcname;
+    wasm_parse_prosrc(prosrc, &instanceid, funcname);
+
+    WasmInstInfo* instanceinfo = find_instance(instanceid);
+    if (instanceinfo == NULL) {
+        ereport(ERROR, (errmsg("wasm_executor: instance with id %ld is not find", instanceid)));
+    }
+
+    WasmCallCache *cache = (WasmCallCache*)flinfo->fn_extra;
+    if (cache == NULL) {
+        cache = (WasmCallCache*)MemoryContextAllocZero(flinfo->fn_mcxt, sizeof(WasmCallCache));
+    }
+
+    cache->nargs = procform->pronargs;
+    cache->rettype = procform->prorettype;
+    cache->retset = procform->proretset;
+    cache->tupdesc = NULL;
+    cache->memo = NULL;
+    cache->batch_nulls = false;
+    cache->retelemtype = get_element_type(cache->rettype);
+    for (int i = 0; i < cache->nargs; i++) {
+        cache->argtypes[i] = procform->proargtypes.values[i];
+        cache->elemtypes[i] = get_element_type(cache->argtypes[i]);
+        cache->rowargs[i] = type_is_rowtype(cache->argtypes[i]);
+    }
+    cache->mode = wasm_call_mode(cache);
+
+    WasmFuncInfo *funcinfo = NULL;
+    switch (cache->mode) {
+        case WASM_CALL_SCALAR:
+            funcinfo = find_exported_func(instanceinfo->module.get(), funcname.c_str(), funcname.length());
+            wasm_call_cache_bind_args(cache, funcinfo, NameStr(procform->proname));
+            wasm_check_result_count(funcinfo, 1, NameStr(procform->proname));
+            wasm_check_result_type(cache->rettype, funcinfo->results[0], NameStr(procform->proname));
+            break;
+        case WASM_CALL_COMPOSITE:
+        case WASM_CALL_SRF:
+            funcinfo = find_exported_func(instanceinfo->module.get(), funcname.c_str(), funcname.length());
+            wasm_call_cache_bind_args(cache, funcinfo, NameStr(procform->proname));
+            wasm_call_cache_bind_rowtype(fcinfo, cache, funcinfo, NameStr(procform->proname));
+            break;
+        case WASM_CALL_BATCH:
+            funcinfo = find_exported_func(instanceinfo->module.get(), funcname.c_str(), funcname.length());
+            wasm_call_cache_bind_batch(cache, funcinfo, NameStr(procform->proname));
+            break;
+        default:
+            wasm_agg_bind_funcs(cache, instanceinfo->module.get(), funcname, NameStr(procform->proname));
+            funcinfo = cache->agg.step;
+            break;
+    }
+    cache->funcinfo = funcinfo;
+    cache->instinfo = instanceinfo;
+    cache->memoizable = (cache->mode == WASM_CALL_SCALAR && procform->provolatile == PROVOLATILE_IMMUTABLE);
+    for (int i = 0; i < cache->nargs; i++) {
+        cache->memoizable = cache->memoizable && !cache->rowargs[i];
+    }
+    cache->session = wasm_session;
+    cache->generation = wasm_session->generation;
+    cache->registry_generation = wasm_session->registry_generation;
+    flinfo->fn_extra = cache;
+
+    pfree(prosrc);
+    ReleaseSysCache(proctup);
+    return cache;
+}
+
+/*
+ * Attributes of a whole-row or composite argument, deformed and detoasted
+ * before the row is packed.
+ */
+typedef struct WasmRowArg {
+    TupleDesc tupdesc;
+    Datum *values;
+    bool *nulls;
+    // The values follow the null bitmap, and the bytea and text contents them
+    size_t bitmap_size;
+    size_t fixed_size;
+    size_t size;
+} WasmRowArg;
+
+static void wasm_row_arg_init(WasmRowArg *row, Datum value, Oid fn_oid)
+{
+    HeapTupleHeader header = DatumGetHeapTupleHeader(value);
+    HeapTupleData tuple;
+    tuple.t_len = HeapTupleHeaderGetDatumLength(header);
+    tuple.t_data = header;
+    row->tupdesc = lookup_rowtype_tupdesc(HeapTupleHeaderGetTypeId(header), HeapTupleHeaderGetTypMod(header));
+
+    int natts = row->tupdesc->natts;
+    row->values = (Datum*)palloc(sizeof(Datum) * natts);
+    row->nulls = (bool*)palloc(sizeof(bool) * natts);
+    heap_deform_tuple(&tuple, row->tupdesc, row->values, row->nulls);
+
+    int nlive = 0;
+    size_t values_size = 0;
+    size_t data_size = 0;
+    for (int i = 0; i < natts; i++) {
+        Form_pg_attribute attr = row->tupdesc->attrs[i];
+        if (attr->attisdropped) {
+            continue;
+        }
+        // Named row types were checked when the function was bound, but may have changed since
+        int width = wasm_row_attr_width(attr->atttypid);
+        if (width == 0) {
+            wasm_check_row_attrs(row->tupdesc, get_func_name(fn_oid));
+        }
+        nlive++;
+        values_size += width;
+        if (!row->nulls[i] && wasm_is_varlena_type(attr->atttypid)) {
+            row->values[i] = PointerGetDatum(PG_DETOAST_DATUM_PACKED(row->values[i]));
+            data_size += VARSIZE_ANY_EXHDR(DatumGetPointer(row->values[i]));
+        }
+    }
+    row->bitmap_size = TYPEALIGN(sizeof(int64), (nlive + 7) / 8);
+    row->fixed_size = row->bitmap_size + values_size;
+    row->size = row->fixed_size + data_size;
+}
+
+/*
+ * Pack a row at buf, which is at guest address ptr: a null bitmap with one
+ * bit per attribute (bit i % 8 of byte i / 8) padded to 8 bytes, then each
+ * value at the width of its wasm kind, as in the rows of set-returning
+ * functions, bytea and text as an (i32 ptr, i32 len) pair, and last the
+ * contents of the bytea and text values. Dropped attributes are left out and
+ * null values are zero.
+ */
+static void wasm_pack_row(WasmRowArg *row, uint8 *buf, uint32 ptr)
+{
+    TupleDesc tupdesc = row->tupdesc;
+    if (row->size == 0) {
+        return;
+    }
+    errno_t rc = memset_s(buf, row->fixed_size, 0, row->fixed_size);
+    securec_check_c(rc, "\0", "\0");
+
+    int attno = 0;
+    size_t offset = row->bitmap_size;
+    size_t data_offset = row->fixed_size;
+    for (int i = 0; i < tupdesc->natts; i++) {
+        Oid typid = tupdesc->attrs[i]->atttypid;
+        if (tupdesc->attrs[i]->attisdropped) {
+            continue;
+        }
+        int width = wasm_row_attr_width(typid);
+        if (row->nulls[i]) {
+            buf[attno / 8] |= (uint8)(1 << (attno % 8));
+        } else if (wasm_is_varlena_type(typid)) {
+            struct varlena *data = (struct varlena*)DatumGetPointer(row->values[i]);
+            uint32 pair[2] = {(uint32)(ptr + data_offset), (uint32)VARSIZE_ANY_EXHDR(data)};
+            if (pair[1] > 0) {
+                rc = memcpy_s(buf + data_offset, row->size - data_offset, VARDATA_ANY(data), pair[1]);
+                securec_check_c(rc, "\0", "\0");
+            }
+            rc = memcpy_s(buf + offset, row->size - offset, pair, sizeof(pair));
+            securec_check_c(rc, "\0", "\0");
+            data_offset += pair[1];
+        } else {
+            wasm_valkind_t kind;
+            wasmtime_val_raw_t raw;
+            (void)wasm_type_valkind(typid, &kind);
+            wasm_datum_to_raw(row->values[i], typid, kind, &raw);
+            rc = memcpy_s(buf + offset, row->size - offset, &raw, width);
+            securec_check_c(rc, "\0", "\0");
+        }
+        offset += width;
+        attno++;
+    }
+}
+
+/*
+ * Write the detoasted bytea/text arguments and the packed rows of a call into
+ * the scratch buffer of the instance, one after another, and fill in their
+ * (ptr, len) slots. The buffer is rewound for every call, so the guest must
+ * not keep pointers into it once the call returns.
+ */
+static void wasm_copy_buffer_args(FunctionCallInfo fcinfo, WasmCallCache *cache, wasmtime_val_raw_t *args_and_results)
+{
+    struct varlena *values[FUNC_MAX_ARGS];
+    WasmRowArg rows[FUNC_MAX_ARGS];
+    size_t total = 0;
+    for (int i = 0; i < cache->nargs; i++) {
+        if (cache->rowargs[i]) {
+            wasm_row_arg_init(&rows[i], PG_GETARG_DATUM(i), fcinfo->flinfo->fn_oid);
+            total += rows[i].size;
+        } else if (wasm_is_varlena_type(cache->argtypes[i])) {
+            values[i] = PG_DETOAST_DATUM_PACKED(PG_GETARG_DATUM(i));
+            total += VARSIZE_ANY_EXHDR(values[i]);
+        }
+    }
+
+    uint32 base = (total > 0) ? wasm_reserve_scratch(cache->instinfo, total) : 0;
+    uint8 *data = (total > 0) ? wasm_guest_memory(cache->instinfo, base, total) : NULL;
+    uint32 offset = 0;
+    for (int i = 0; i < cache->nargs; i++) {
+        uint32 len = 0;
+        if (cache->rowargs[i]) {
+            len = (uint32)rows[i].size;
+            wasm_pack_row(&rows[i], data + offset, base + offset);
+            ReleaseTupleDesc(rows[i].tupdesc);
+            pfree(rows[i].values);
+            pfree(rows[i].nulls);
+        } else if (wasm_is_varlena_type(cache->argtypes[i])) {
+            len = VARSIZE_ANY_EXHDR(values[i]);
+            if (len > 0) {
+                errno_t rc = memcpy_s(data + offset, total - offset, VARDATA_ANY(values[i]), len);
+                securec_check_c(rc, "\0", "\0");
+            }
+        } else {
+            continue;
+        }
+        args_and_results[cache->argslots[i]].i32 = (int32)(base + offset);
+        args_and_results[cache->argslots[i] + 1].i32 = (int32)len;
+        offset += len;
+    }
+    wasm_stat_bytes(cache->instinfo, cache->funcinfo, total, 0);
+}
+
+/*
+ * Copy a bytea/text result out of linear memory into a new varlena. The
+ * guest owns the buffer and it only has to stay valid until the next call.
+ */
+static struct varlena* wasm_copy_varlena_result(WasmInstInfo *instinfo, WasmFuncInfo *funcinfo, Oid rettype,
+    uint32 ptr, uint32 len)
+{
+    if (len > MaxAllocSize - VARHDRSZ) {
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+            errmsg("wasm_executor: result of %u bytes is too large", len)));
+    }
+    const char *data = (const char*)wasm_guest_memory(instinfo, ptr, len);
+    if (rettype == TEXTOID) {
+        (void)pg_verifymbstr(data, len, false);
+    }
+
+    struct varlena *result = (struct varlena*)palloc(len + VARHDRSZ);
+    SET_VARSIZE(result, len + VARHDRSZ);
+    if (len > 0) {
+        errno_t rc = memcpy_s(VARDATA(result), len, data, len);
+        securec_check_c(rc, "\0", "\0");
+    }
+    wasm_stat_bytes(instinfo, funcinfo, 0, len);
+    return result;
+}
+
+/*
+ * Convert a result of funcinfo to the SQL type rettype.
+ */
+static Datum wasm_value_datum(WasmInstInfo *instinfo, WasmFuncInfo *funcinfo, Oid rettype, wasm_valkind_t kind,
+    const wasmtime_val_raw_t *result)
+{
+    if (wasm_is_varlena_type(rettype)) {
+        uint64 packed = (uint64)result->i64;
+        return PointerGetDatum(wasm_copy_varlena_result(instinfo, funcinfo, rettype,
+            (uint32)(packed >> 32), (uint32)packed));
+    }
+
+    return wasm_raw_to_datum(rettype, kind, result);
+}
+
+static inline Datum wasm_result_datum(WasmCallCache *cache, WasmFuncInfo *funcinfo, const wasmtime_val_raw_t *result)
+{
+    return wasm_value_datum(cache->instinfo, funcinfo, cache->rettype, funcinfo->results[0], result);
+}
+
+/*
+ * Hand the buffered rows of an aggregate to <prefix>_step, through the
+ * scratch buffer of the instance and with the layout of batch calls: one
+ * column after another, each holding nrows values.
+ */
+static void wasm_agg_flush(WasmCallCache *cache, WasmAggState *state)
+{
+    if (state->nrows == 0) {
+        return;
+    }
+    WasmInstInfo *instinfo = state->instinfo;
+    size_t insize = (size_t)state->rowwidth * state->nrows;
+    uint32 base = wasm_reserve_scratch(instinfo, insize);
+    uint8 *data = wasm_guest_memory(instinfo, base, insize);
+    const char *column = state->columns;
+    for (int i = 0; i < state->ncols; i++) {
+        size_t colsize = (size_t)state->widths[i] * state->nrows;
+        errno_t rc = memcpy_s(data, colsize, column, colsize);
+        securec_check_c(rc, "\0", "\0");
+        data += colsize;
+        column += (size_t)state->widths[i] * state->capacity;
+    }
+    wasm_stat_bytes(instinfo, cache->agg.step, insize, 0);
+
+    wasmtime_val_raw_t args_and_results[3];
+    args_and_results[0].i32 = (int32)state->guest_state;
+    args_and_results[1].i32 = (int32)base;
+    args_and_results[2].i32 = state->nrows;
+    state->nrows = 0;
+    wasm_call_raw(instinfo, cache->agg.step, args_and_results);
+}
+
+/*
+ * Reset callback of the aggregate context. It also runs when the query fails
+ * or a window partition ends, so the state is queued for <prefix>_free on the
+ * next checkout of the instance, unless that was restarted in the meantime.
+ */
+static void wasm_agg_release_state(void *arg)
+{
+    WasmAggState *state = (WasmAggState*)arg;
+    if (state->instinfo == NULL || wasm_session == NULL) {
+        return;
+    }
+    std::unordered_map<int64, WasmInstInfo*>::iterator itor = wasm_session->instances.find(state->instance_id);
+    if (itor != wasm_session->instances.end() && itor->second == state->instinfo &&
+        state->instinfo->starts == state->instance_starts) {
+        state->instinfo->pending_frees.push_back(std::make_pair(state->free_func, state->guest_state));
+    }
+    state->instinfo = NULL;
+}
 
-        inter_call_data->tupd = tupdesc;
-        inter_call_data->currindex = instances.begin();
-        inter_call_data->lastindex = instances.end();
+/*
+ * Create the state of a new group: <prefix>_init allocates it in the guest.
+ * Input columns are described by the transition function; a state created by
+ * the final function never receives rows.
+ */
+static WasmAggState* wasm_agg_create_state(WasmCallCache *cache, MemoryContext aggcontext)
+{
+    WasmAggState *state = (WasmAggState*)MemoryContextAllocZero(aggcontext, sizeof(WasmAggState));
+    state->instinfo = cache->instinfo;
+    state->instance_id = cache->instinfo->module->id;
+    state->instance_starts = cache->instinfo->starts;
+    state->free_func = cache->agg.free;
+    if (cache->mode == WASM_CALL_AGG_TRANS) {
+        state->ncols = cache->nargs - 1;
+        for (int i = 0; i < state->ncols; i++) {
+            state->widths[i] = wasm_column_width(cache->argtypes[i + 1]);
+            state->rowwidth += state->widths[i];
+        }
+    }
 
-        fctx->user_fctx = inter_call_data;
-        MemoryContextSwitchTo(mctx);
+    wasmtime_val_raw_t result;
+    wasm_call_raw(cache->instinfo, cache->agg.init, &result);
+    state->guest_state = (uint32)result.i32;
+    if (state->free_func != NULL) {
+        state->release.func = wasm_agg_release_state;
+        state->release.arg = state;
+        MemoryContextRegisterResetCallback(aggcontext, &state->release);
+    }
+    return state;
+}
+
+static WasmAggState* wasm_agg_get_state(FunctionCallInfo fcinfo, WasmCallCache *cache, int argno,
+    MemoryContext aggcontext)
+{
+    if (PG_ARGISNULL(argno)) {
+        return wasm_agg_create_state(cache, aggcontext);
+    }
+    WasmAggState *state = (WasmAggState*)PG_GETARG_POINTER(argno);
+    if (state->instinfo != cache->instinfo || state->instance_starts != cache->instinfo->starts) {
+        ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+            errmsg("wasm_executor: the instance holding the aggregate state was reset")));
     }
+    return state;
+}
 
-    fctx = SRF_PERCALL_SETUP();
-    inter_call_data = (TupleInstanceState*)(fctx->user_fctx);
-    
-    if (inter_call_data->currindex != inter_call_data->lastindex) {
-        HeapTuple resultTuple;
-        Datum result;
-        Datum values[2];
-        bool nulls[2];
+static MemoryContext wasm_agg_context(FunctionCallInfo fcinfo)
+{
+    MemoryContext aggcontext = NULL;
+    if (!AggCheckCallContext(fcinfo, &aggcontext)) {
+        ereport(ERROR, (errmsg("wasm_executor: aggregate function called in non-aggregate context")));
+    }
+    return aggcontext;
+}
 
-        errno_t rc = memset_s(nulls, sizeof(nulls), 0, sizeof(nulls));
+/*
+ * Transition function: rows with a NULL input are skipped, the others are
+ * appended to the buffer, which is flushed to the guest once full.
+ */
+static Datum wasm_agg_transfn(FunctionCallInfo fcinfo, WasmCallCache *cache)
+{
+    MemoryContext aggcontext = wasm_agg_context(fcinfo);
+    WasmAggState *state = wasm_agg_get_state(fcinfo, cache, 0, aggcontext);
+    for (int i = 1; i < cache->nargs; i++) {
+        if (PG_ARGISNULL(i)) {
+            PG_RETURN_POINTER(state);
+        }
+    }
+
+    if (state->nrows == state->capacity) {
+        wasm_agg_flush(cache, state);
+        // Start small, most groups of a hash aggregate only see a few rows
+        if (state->capacity < WASM_AGG_BATCH_ROWS) {
+            int capacity = Min(Max(state->capacity * 4, 16), WASM_AGG_BATCH_ROWS);
+            if (state->columns != NULL) {
+                pfree(state->columns);
+            }
+            state->columns = (char*)MemoryContextAlloc(aggcontext, (size_t)state->rowwidth * capacity);
+            state->capacity = capacity;
+        }
+    }
+
+    char *column = state->columns;
+    for (int i = 0; i < state->ncols; i++) {
+        char *value = column + (size_t)state->widths[i] * state->nrows;
+        Oid argtype = cache->argtypes[i + 1];
+        wasm_valkind_t kind;
+        wasmtime_val_raw_t raw;
+        (void)wasm_type_valkind(argtype, &kind);
+        wasm_datum_to_raw(PG_GETARG_DATUM(i + 1), argtype, kind, &raw);
+        errno_t rc = memcpy_s(value, state->widths[i], &raw, state->widths[i]);
         securec_check_c(rc, "\0", "\0");
+        column += (size_t)state->widths[i] * state->capacity;
+    }
+    state->nrows++;
+    PG_RETURN_POINTER(state);
+}
 
-        WasmInstInfo *instanceinfo = inter_call_data->currindex->second;
-        values[0] = Int64GetDatum(inter_call_data->currindex->first);
-        values[1] = CStringGetTextDatum(instanceinfo->wasm_file.c_str());
+/*
+ * Final function: flush the remaining rows and compute the result with
+ * <prefix>_final. A group without rows gets a fresh state, so the guest
+ * decides what an empty aggregate returns. Window aggregates may call the
+ * final function repeatedly, so the state is only freed in plain aggregates.
+ */
+static Datum wasm_agg_finalfn(FunctionCallInfo fcinfo, WasmCallCache *cache)
+{
+    MemoryContext aggcontext = NULL;
+    int aggkind = AggCheckCallContext(fcinfo, &aggcontext);
+    if (aggkind == 0) {
+        ereport(ERROR, (errmsg("wasm_executor: aggregate function called in non-aggregate context")));
+    }
+    WasmAggState *state = wasm_agg_get_state(fcinfo, cache, 0, aggcontext);
+    wasm_agg_flush(cache, state);
 
-        /* Build and return the result tuple. */
-        resultTuple = heap_form_tuple(inter_call_data->tupd, values, nulls);
-        result = HeapTupleGetDatum(resultTuple);
+    WasmFuncInfo *final = cache->agg.final;
+    wasmtime_val_raw_t args_and_results[1];
+    args_and_results[0].i32 = (int32)state->guest_state;
+    wasm_call_raw(cache->instinfo, final, args_and_results);
+    Datum result = wasm_result_datum(cache, final, args_and_results);
 
-        inter_call_data->currindex++;
-        SRF_RETURN_NEXT(fctx, result);
-    } else {
-        SRF_RETURN_DONE(fctx);
+    if (aggkind == AGG_CONTEXT_AGGREGATE && cache->agg.free != NULL) {
+        args_and_results[0].i32 = (int32)state->guest_state;
+        wasm_call_raw(cache->instinfo, cache->agg.free, args_and_results);
+        state->instinfo = NULL;
     }
+    return result;
 }
 
-PG_FUNCTION_INFO_V1(wasm_get_exported_functions);
-Datum wasm_get_exported_functions(PG_FUNCTION_ARGS) 
+/*
+ * Fill in the parameters of a scalar, composite or set-returning call. Returns
+ * false if any argument is null.
+ */
+static bool wasm_call_set_args(FunctionCallInfo fcinfo, WasmCallCache *cache, wasmtime_val_raw_t *args_and_results)
 {
-    int64 instanceid = PG_GETARG_INT64(0);
-    FuncCallContext* fctx = NULL;
-    TupleFuncState* inter_call_data = NULL;
-    if (SRF_IS_FIRSTCALL()) {
-        TupleDesc tupdesc;
-        MemoryContext mctx;
+    WasmFuncInfo *funcinfo = cache->funcinfo;
+    for (int i = 0; i < cache->nargs; i++) {
+        if (PG_ARGISNULL(i)) {
+            return false;
+        }
+    }
+    if (cache->has_buffers) {
+        wasm_copy_buffer_args(fcinfo, cache, args_and_results);
+    }
+    for (int i = 0; i < cache->nargs; i++) {
+        if (wasm_is_varlena_type(cache->argtypes[i]) || cache->rowargs[i]) {
+            continue;
+        }
+        int slot = cache->argslots[i];
+        wasm_datum_to_raw(PG_GETARG_DATUM(i), cache->argtypes[i], funcinfo->params[slot], &args_and_results[slot]);
+    }
+    return true;
+}
 
-        fctx = SRF_FIRSTCALL_INIT();
-        mctx = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
-        inter_call_data = (TupleFuncState*)palloc(sizeof(TupleFuncState));
-        
-        /* Build a tuple descriptor for our result type */
-        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-            elog(ERROR, "wasm_executor: return type must be a row type");
+/*
+ * Form the row of a composite function from the results of a multi-value
+ * export, one column per result.
+ */
+static Datum wasm_composite_datum(WasmCallCache *cache, WasmFuncInfo *funcinfo, const wasmtime_val_raw_t *results)
+{
+    TupleDesc tupdesc = cache->tupdesc;
+    Datum values[tupdesc->natts];
+    bool nulls[tupdesc->natts];
+    size_t result = 0;
+    for (int i = 0; i < tupdesc->natts; i++) {
+        nulls[i] = tupdesc->attrs[i]->attisdropped;
+        if (nulls[i]) {
+            values[i] = (Datum)0;
+            continue;
+        }
+        values[i] = wasm_value_datum(cache->instinfo, funcinfo, tupdesc->attrs[i]->atttypid,
+            funcinfo->results[result], &results[result]);
+        result++;
+    }
+    return HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls));
+}
 
-        inter_call_data->tupd = tupdesc;
-        wasm_export_funcs_query(instanceid, inter_call_data);
+/*
+ * Append nrows rows of the result type of a set-returning function, packed at
+ * ptr in linear memory. Rows are packed without padding, each column taking
+ * the size of its wasm value kind, and bytea/text an (i32 ptr, i32 len) pair.
+ */
+static void wasm_srf_put_rows(WasmCallCache *cache, Tuplestorestate *tupstore, uint32 ptr, uint32 nrows)
+{
+    WasmFuncInfo *funcinfo = cache->funcinfo;
+    size_t total = (size_t)nrows * cache->rowwidth;
+    const uint8 *rows = (nrows > 0) ? wasm_guest_memory(cache->instinfo, ptr, total) : NULL;
+    wasm_stat_bytes(cache->instinfo, funcinfo, 0, total);
 
-        fctx->user_fctx = inter_call_data;
-        MemoryContextSwitchTo(mctx);
+    TupleDesc tupdesc = cache->tupdesc;
+    Datum values[tupdesc->natts];
+    bool nulls[tupdesc->natts];
+    for (uint32 row = 0; row < nrows; row++) {
+        for (int i = 0; i < tupdesc->natts; i++) {
+            Oid coltype = tupdesc->attrs[i]->atttypid;
+            nulls[i] = tupdesc->attrs[i]->attisdropped;
+            values[i] = (Datum)0;
+            if (nulls[i]) {
+                continue;
+            }
+            wasm_valkind_t kind;
+            if (!wasm_is_varlena_type(coltype) && wasm_type_valkind(coltype, &kind)) {
+                wasmtime_val_raw_t value;
+                errno_t rc = memcpy_s(&value, sizeof(value), rows, wasm_valkind_size(kind));
+                securec_check_c(rc, "\0", "\0");
+                values[i] = wasm_raw_to_datum(coltype, kind, &value);
+                rows += wasm_valkind_size(kind);
+            } else {
+                uint32 ref[2];
+                errno_t rc = memcpy_s(ref, sizeof(ref), rows, sizeof(ref));
+                securec_check_c(rc, "\0", "\0");
+                values[i] = PointerGetDatum(wasm_copy_varlena_result(cache->instinfo, funcinfo, coltype, ref[0], ref[1]));
+                rows += sizeof(ref);
+            }
+        }
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+        for (int i = 0; i < tupdesc->natts; i++) {
+            if (!nulls[i] && wasm_is_varlena_type(tupdesc->attrs[i]->atttypid)) {
+                pfree(DatumGetPointer(values[i]));
+            }
+        }
     }
-    fctx = SRF_PERCALL_SETUP();
-    inter_call_data = (TupleFuncState*)(fctx->user_fctx);
-    
-    if (inter_call_data->currindex != inter_call_data->lastindex) {
-        HeapTuple resultTuple;
-        Datum result;
-        Datum values[3];
-        bool nulls[3];
+}
 
-        errno_t rc = memset_s(nulls, sizeof(nulls), 0, sizeof(nulls));
-        securec_check_c(rc, "\0", "\0");
+/*
+ * Set-returning call. The export takes the arguments of the function and
+ * fills a buffer of rows in linear memory with one call, returning an i64
+ * holding the buffer in the high and the number of rows in the low 32 bits.
+ * Like any result the buffer only has to stay valid until the next call, so
+ * the rows are materialized into a tuplestore before the instance is entered
+ * again. Rows may also be handed over during the call through pg.emit_rows.
+ */
+static Datum wasm_call_handler_srf(FunctionCallInfo fcinfo, WasmCallCache *cache)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize)) {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+            errmsg("wasm_executor: set-valued function called in context that cannot accept a set")));
+    }
 
-        WasmFuncInfo *funcinfo = *inter_call_data->currindex;
-        values[0] = CStringGetTextDatum(funcinfo->funcname.c_str());
-        values[1] = CStringGetTextDatum(funcinfo->inputs.c_str());
-        values[2] = CStringGetTextDatum(funcinfo->outputs.c_str());
+    WasmFuncInfo *funcinfo = cache->funcinfo;
+    wasmtime_val_raw_t args_and_results[funcinfo->nraw];
+    if (!wasm_call_set_args(fcinfo, cache, args_and_results)) {
+        rsinfo->isDone = ExprEndResult;
+        PG_RETURN_NULL();
+    }
 
-        /* Build and return the result tuple. */
-        resultTuple = heap_form_tuple(inter_call_data->tupd, values, nulls);
-        result = HeapTupleGetDatum(resultTuple);
-        inter_call_data->currindex++;
+    MemoryContext oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    Tuplestorestate *tupstore = tuplestore_begin_heap((rsinfo->allowedModes & SFRM_Materialize_Random) != 0, false,
+        u_sess->attr.attr_memory.work_mem);
+    MemoryContextSwitchTo(oldcontext);
 
-        SRF_RETURN_NEXT(fctx, result);
-    } else {
-        SRF_RETURN_DONE(fctx);
+    WasmSessionState *session = cache->session;
+    WasmCallCache *outer_cache = session->emit_cache;
+    Tuplestorestate *outer_store = session->emit_store;
+    session->emit_cache = cache;
+    session->emit_store = tupstore;
+    PG_TRY();
+    {
+        wasm_call_raw(cache->instinfo, funcinfo, args_and_results);
     }
+    PG_CATCH();
+    {
+        session->emit_cache = outer_cache;
+        session->emit_store = outer_store;
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    session->emit_cache = outer_cache;
+    session->emit_store = outer_store;
+
+    uint64 packed = (uint64)args_and_results[0].i64;
+    wasm_srf_put_rows(cache, tupstore, (uint32)(packed >> 32), (uint32)packed);
+
+    oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = CreateTupleDescCopy(cache->tupdesc);
+    MemoryContextSwitchTo(oldcontext);
+    return (Datum)0;
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_0);
-Datum wasm_invoke_function_0(PG_FUNCTION_ARGS)
+/*
+ * Host imports of module "pg". They take guest pointers into the linear
+ * memory of the calling instance and move whole batches per call, so a guest
+ * walking a large result does not pay a boundary crossing per row:
+ *
+ *   cursor_open(sql_ptr, sql_len) -> cursor    open a cursor for a query
+ *   cursor_find(name_ptr, name_len) -> cursor  use a cursor declared in SQL
+ *   cursor_fetch(cursor, buf_ptr, buf_len) -> nrows
+ *   cursor_close(cursor)
+ *   emit_rows(rows_ptr, nrows)                 add rows to the result set
+ *   log(level, msg_ptr, msg_len)
+ *
+ * Fetched rows are packed like the rows of a set-returning function. All
+ * parameters and results are i32.
+ */
+typedef void (*WasmHostFn)(WasmInstInfo *instinfo, const wasmtime_val_t *args, wasmtime_val_t *results);
+
+typedef struct WasmHostImport {
+    const char *name;
+    size_t nparams;
+    size_t nresults;
+    WasmHostFn fn;
+} WasmHostImport;
+
+static const int wasm_host_log_levels[] = {DEBUG1, LOG, INFO, NOTICE, WARNING};
+
+static std::string wasm_host_string(WasmInstInfo *instinfo, int32 ptr, int32 len)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
+    if (len < 0) {
+        ereport(ERROR, (errmsg("wasm_executor: invalid string length %d", len)));
+    }
+    const char *data = (const char*)wasm_guest_memory(instinfo, (uint32)ptr, (size_t)len);
+    (void)pg_verifymbstr(data, len, false);
+    return std::string(data, len);
+}
 
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+static int32 wasm_host_add_cursor(const char *name)
+{
+    std::vector<std::string> &cursors = wasm_session->cursors;
+    std::vector<std::string>::iterator itor = std::find(cursors.begin(), cursors.end(), std::string());
+    if (itor != cursors.end()) {
+        *itor = name;
+        return (int32)(itor - cursors.begin());
+    }
+    cursors.push_back(name);
+    return (int32)(cursors.size() - 1);
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_1);
-Datum wasm_invoke_function_1(PG_FUNCTION_ARGS)
+static Portal wasm_host_find_cursor(int32 handle)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
+    std::vector<std::string> &cursors = wasm_session->cursors;
+    Portal portal = NULL;
+    if (handle >= 0 && (size_t)handle < cursors.size() && !cursors[handle].empty()) {
+        portal = SPI_cursor_find(cursors[handle].c_str());
+    }
+    if (portal == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_UNDEFINED_CURSOR), errmsg("wasm_executor: cursor %d does not exist", handle)));
+    }
+    return portal;
+}
 
-    params.push_back(PG_GETARG_INT64(2));
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+static void wasm_host_cursor_open(WasmInstInfo *instinfo, const wasmtime_val_t *args, wasmtime_val_t *results)
+{
+    std::string sql = wasm_host_string(instinfo, args[0].of.i32, args[1].of.i32);
+    if (SPI_connect() != SPI_OK_CONNECT) {
+        ereport(ERROR, (errmsg("wasm_executor: SPI_connect failed")));
+    }
+    Portal portal = SPI_cursor_open_with_args(NULL, sql.c_str(), 0, NULL, NULL, NULL, false, CURSOR_OPT_NO_SCROLL);
+    if (portal == NULL) {
+        ereport(ERROR, (errmsg("wasm_executor: could not open cursor for \"%s\"", sql.c_str())));
+    }
+    results[0].of.i32 = wasm_host_add_cursor(portal->name);
+    SPI_finish();
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_2);
-Datum wasm_invoke_function_2(PG_FUNCTION_ARGS)
+static void wasm_host_cursor_find(WasmInstInfo *instinfo, const wasmtime_val_t *args, wasmtime_val_t *results)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
+    std::string name = wasm_host_string(instinfo, args[0].of.i32, args[1].of.i32);
+    if (SPI_cursor_find(name.c_str()) == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_UNDEFINED_CURSOR),
+            errmsg("wasm_executor: cursor \"%s\" does not exist", name.c_str())));
+    }
+    results[0].of.i32 = wasm_host_add_cursor(name.c_str());
+}
 
-    params.push_back(PG_GETARG_INT64(2));
-    params.push_back(PG_GETARG_INT64(3));
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+/*
+ * Fetch as many rows as fit in the buffer, and return how many were copied.
+ * 0 means the cursor is exhausted.
+ */
+static void wasm_host_cursor_fetch(WasmInstInfo *instinfo, const wasmtime_val_t *args, wasmtime_val_t *results)
+{
+    Portal portal = wasm_host_find_cursor(args[0].of.i32);
+    TupleDesc tupdesc = portal->tupDesc;
+    if (tupdesc == NULL || tupdesc->natts == 0) {
+        ereport(ERROR, (errmsg("wasm_executor: cursor %d does not return rows", args[0].of.i32)));
+    }
+
+    wasm_valkind_t kinds[tupdesc->natts];
+    size_t rowwidth = 0;
+    for (int i = 0; i < tupdesc->natts; i++) {
+        Oid coltype = tupdesc->attrs[i]->atttypid;
+        if (wasm_is_varlena_type(coltype) || !wasm_type_valkind(coltype, &kinds[i])) {
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("wasm_executor: column %d of cursor %d has type %s, which cannot be fetched into wasm",
+                    i + 1, args[0].of.i32, format_type_be(coltype))));
+        }
+        rowwidth += wasm_valkind_size(kinds[i]);
+    }
+    long maxrows = (long)((uint32)args[2].of.i32 / rowwidth);
+    if (maxrows == 0) {
+        ereport(ERROR, (errmsg("wasm_executor: buffer of %u bytes cannot hold a row of %lu bytes",
+            (uint32)args[2].of.i32, rowwidth)));
+    }
+
+    (void)wasm_guest_memory(instinfo, (uint32)args[1].of.i32, (uint32)args[2].of.i32);
+
+    if (SPI_connect() != SPI_OK_CONNECT) {
+        ereport(ERROR, (errmsg("wasm_executor: SPI_connect failed")));
+    }
+    SPI_cursor_fetch(portal, true, maxrows);
+    uint32 nrows = (uint32)SPI_processed;
+    // The query may have called into the guest and moved its memory
+    uint8 *buf = (nrows > 0) ? wasm_guest_memory(instinfo, (uint32)args[1].of.i32, nrows * rowwidth) : NULL;
+    for (uint32 row = 0; row < nrows; row++) {
+        HeapTuple tuple = SPI_tuptable->vals[row];
+        for (int i = 0; i < tupdesc->natts; i++) {
+            bool isnull = false;
+            Datum value = SPI_getbinval(tuple, SPI_tuptable->tupdesc, i + 1, &isnull);
+            if (isnull) {
+                ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                    errmsg("wasm_executor: column %d of cursor %d is null", i + 1, args[0].of.i32)));
+            }
+            wasmtime_val_raw_t raw;
+            wasm_datum_to_raw(value, tupdesc->attrs[i]->atttypid, kinds[i], &raw);
+            errno_t rc = memcpy_s(buf, wasm_valkind_size(kinds[i]), &raw, wasm_valkind_size(kinds[i]));
+            securec_check_c(rc, "\0", "\0");
+            buf += wasm_valkind_size(kinds[i]);
+        }
+    }
+    SPI_freetuptable(SPI_tuptable);
+    SPI_finish();
+    results[0].of.i32 = (int32)nrows;
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_3);
-Datum wasm_invoke_function_3(PG_FUNCTION_ARGS)
+static void wasm_host_cursor_close(WasmInstInfo *instinfo, const wasmtime_val_t *args, wasmtime_val_t *results)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
+    SPI_cursor_close(wasm_host_find_cursor(args[0].of.i32));
+    wasm_session->cursors[args[0].of.i32].clear();
+}
 
-    params.push_back(PG_GETARG_INT64(2));
-    params.push_back(PG_GETARG_INT64(3));
-    params.push_back(PG_GETARG_INT64(4));
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+static void wasm_host_emit_rows(WasmInstInfo *instinfo, const wasmtime_val_t *args, wasmtime_val_t *results)
+{
+    WasmCallCache *cache = wasm_session->emit_cache;
+    if (cache == NULL || cache->instinfo != instinfo) {
+        ereport(ERROR, (errmsg("wasm_executor: %s.emit_rows called outside of a set-returning function",
+            WASM_HOST_MODULE)));
+    }
+    if (args[1].of.i32 < 0) {
+        ereport(ERROR, (errmsg("wasm_executor: invalid row count %d", args[1].of.i32)));
+    }
+    wasm_srf_put_rows(cache, wasm_session->emit_store, (uint32)args[0].of.i32, (uint32)args[1].of.i32);
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_4);
-Datum wasm_invoke_function_4(PG_FUNCTION_ARGS)
+static void wasm_host_log(WasmInstInfo *instinfo, const wasmtime_val_t *args, wasmtime_val_t *results)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
+    int32 level = args[0].of.i32;
+    if (level < 0 || (size_t)level >= lengthof(wasm_host_log_levels)) {
+        ereport(ERROR, (errmsg("wasm_executor: invalid log level %d", level)));
+    }
+    std::string message = wasm_host_string(instinfo, args[1].of.i32, args[2].of.i32);
+    ereport(wasm_host_log_levels[level], (errmsg("%s", message.c_str())));
+}
 
-    params.push_back(PG_GETARG_INT64(2));
-    params.push_back(PG_GETARG_INT64(3));
-    params.push_back(PG_GETARG_INT64(4));
-    params.push_back(PG_GETARG_INT64(5));
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+static const WasmHostImport wasm_host_imports[] = {
+    {"cursor_open", 2, 1, wasm_host_cursor_open},
+    {"cursor_find", 2, 1, wasm_host_cursor_find},
+    {"cursor_fetch", 3, 1, wasm_host_cursor_fetch},
+    {"cursor_close", 1, 0, wasm_host_cursor_close},
+    {"emit_rows", 2, 0, wasm_host_emit_rows},
+    {"log", 3, 0, wasm_host_log},
+};
+
+/*
+ * Entry of every host import. An ERROR must not unwind through guest frames,
+ * so it is caught here and a trap unwinds the guest instead; the host side of
+ * the call then rethrows the ERROR, see wasm_rethrow_host_error. Nothing runs
+ * in between, so the import does not need a subtransaction of its own.
+ */
+static wasm_trap_t* wasm_host_trampoline(void *env, wasmtime_caller_t *caller, const wasmtime_val_t *args,
+    size_t nargs, wasmtime_val_t *results, size_t nresults)
+{
+    const WasmHostImport *import = (const WasmHostImport*)env;
+    wasmtime_context_t *context = wasmtime_caller_context(caller);
+    WasmInstInfo *instinfo = (WasmInstInfo*)wasmtime_context_get_data(context);
+    // While the guest runs, its store must only be used through the caller
+    wasmtime_context_t *outer_context = instinfo->wasm_context;
+    instinfo->wasm_context = context;
+    for (size_t i = 0; i < nresults; i++) {
+        results[i].kind = WASMTIME_I32;
+        results[i].of.i32 = 0;
+    }
+
+    MemoryContext oldcontext = CurrentMemoryContext;
+    volatile bool failed = false;
+    wasm_session->host_depth++;
+    PG_TRY();
+    {
+        import->fn(instinfo, args, results);
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(oldcontext);
+        wasm_session->host_error = CopyErrorData();
+        FlushErrorState();
+        failed = true;
+    }
+    PG_END_TRY();
+    wasm_session->host_depth--;
+    instinfo->wasm_context = outer_context;
+
+    if (!failed) {
+        return NULL;
+    }
+    std::string message = std::string(WASM_HOST_MODULE) + "." + import->name + " failed";
+    return wasmtime_trap_new(message.c_str(), message.length());
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_5);
-Datum wasm_invoke_function_5(PG_FUNCTION_ARGS)
+/*
+ * Define the host imports, with no ereport as it runs under wasm_engine_lock.
+ */
+static wasmtime_linker_t* wasm_create_linker(wasm_engine_t *engine)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
+    wasmtime_linker_t *linker = wasmtime_linker_new(engine);
+    if (linker == NULL) {
+        return NULL;
+    }
+    for (const WasmHostImport &import : wasm_host_imports) {
+        wasm_valtype_vec_t params;
+        wasm_valtype_vec_t results;
+        wasm_valtype_vec_new_uninitialized(&params, import.nparams);
+        for (size_t i = 0; i < import.nparams; i++) {
+            params.data[i] = wasm_valtype_new(WASM_I32);
+        }
+        wasm_valtype_vec_new_uninitialized(&results, import.nresults);
+        for (size_t i = 0; i < import.nresults; i++) {
+            results.data[i] = wasm_valtype_new(WASM_I32);
+        }
+        wasm_functype_t *functype = wasm_functype_new(&params, &results);
+        wasmtime_error_t *error_msg = wasmtime_linker_define_func(linker, WASM_HOST_MODULE, strlen(WASM_HOST_MODULE),
+            import.name, strlen(import.name), functype, wasm_host_trampoline, (void*)&import, NULL);
+        wasm_functype_delete(functype);
+        if (error_msg != NULL) {
+            wasmtime_error_delete(error_msg);
+            wasmtime_linker_delete(linker);
+            return NULL;
+        }
+    }
+    return linker;
+}
 
-    params.push_back(PG_GETARG_INT64(2));
-    params.push_back(PG_GETARG_INT64(3));
-    params.push_back(PG_GETARG_INT64(4));
-    params.push_back(PG_GETARG_INT64(5));
-    params.push_back(PG_GETARG_INT64(6));
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+static wasmtime_linker_t* wasm_get_linker(wasm_engine_t *engine)
+{
+    wasmtime_linker_t *linker = NULL;
+    {
+        std::lock_guard<std::mutex> guard(wasm_engine_lock);
+        wasmtime_linker_t *&entry = wasm_linkers[engine];
+        if (entry == NULL) {
+            entry = wasm_create_linker(engine);
+        }
+        linker = entry;
+    }
+    if (linker == NULL) {
+        ereport(ERROR, (errmsg("wasm_executor: unable to define the host imports")));
+    }
+    return linker;
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_6);
-Datum wasm_invoke_function_6(PG_FUNCTION_ARGS)
+/*
+ * Result cache of the function in this session, or NULL if memoization is
+ * off. Emptied when its capacity changed or the function now calls another
+ * export.
+ */
+static WasmMemoCache* wasm_memo_get(FunctionCallInfo fcinfo, WasmCallCache *cache)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
-
-    params.push_back(PG_GETARG_INT64(2));
-    params.push_back(PG_GETARG_INT64(3));
-    params.push_back(PG_GETARG_INT64(4));
-    params.push_back(PG_GETARG_INT64(5));
-    params.push_back(PG_GETARG_INT64(6));
-    params.push_back(PG_GETARG_INT64(7));
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+    int capacity = wasm_get_session_context()->memoize_entries;
+    if (capacity <= 0) {
+        return NULL;
+    }
+
+    WasmMemoCache *memo = cache->memo;
+    if (memo == NULL) {
+        WasmMemoCache *&entry = cache->session->memos[fcinfo->flinfo->fn_oid];
+        if (entry == NULL) {
+            entry = new (std::nothrow)WasmMemoCache();
+            if (entry == NULL) {
+                ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("wasm_executor: out of memory")));
+            }
+            entry->capacity = 0;
+        }
+        memo = entry;
+        if (memo->module.lock() != cache->instinfo->module || memo->funcinfo != cache->funcinfo) {
+            memo->module = cache->instinfo->module;
+            memo->funcinfo = cache->funcinfo;
+            memo->capacity = 0;
+        }
+        cache->memo = memo;
+    }
+    if (memo->capacity != (size_t)capacity) {
+        memo->entries.clear();
+        memo->index.clear();
+        memo->hand = 0;
+        memo->capacity = capacity;
+    }
+    return memo;
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_7);
-Datum wasm_invoke_function_7(PG_FUNCTION_ARGS)
+/*
+ * Build the memoization key of a call from its argument values. Returns false
+ * if an argument is null or too large to be worth caching.
+ */
+static bool wasm_memo_key(FunctionCallInfo fcinfo, WasmCallCache *cache, std::string &key)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
-
-    params.push_back(PG_GETARG_INT64(2));
-    params.push_back(PG_GETARG_INT64(3));
-    params.push_back(PG_GETARG_INT64(4));
-    params.push_back(PG_GETARG_INT64(5));
-    params.push_back(PG_GETARG_INT64(6));
-    params.push_back(PG_GETARG_INT64(7));
-    params.push_back(PG_GETARG_INT64(8));
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+    for (int i = 0; i < cache->nargs; i++) {
+        if (PG_ARGISNULL(i)) {
+            return false;
+        }
+        Datum value = PG_GETARG_DATUM(i);
+        if (!wasm_is_varlena_type(cache->argtypes[i])) {
+            key.append((const char*)&value, sizeof(Datum));
+            continue;
+        }
+        struct varlena *data = PG_DETOAST_DATUM_PACKED(value);
+        uint32 len = VARSIZE_ANY_EXHDR(data);
+        if (key.size() + len > WASM_MEMO_MAX_BYTES) {
+            return false;
+        }
+        key.append((const char*)&len, sizeof(len));
+        key.append(VARDATA_ANY(data), len);
+    }
+    return true;
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_8);
-Datum wasm_invoke_function_8(PG_FUNCTION_ARGS)
+static bool wasm_memo_lookup(WasmMemoCache *memo, const std::string &key, Oid rettype, Datum *result)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
-
-    params.push_back(PG_GETARG_INT64(2));
-    params.push_back(PG_GETARG_INT64(3));
-    params.push_back(PG_GETARG_INT64(4));
-    params.push_back(PG_GETARG_INT64(5));
-    params.push_back(PG_GETARG_INT64(6));
-    params.push_back(PG_GETARG_INT64(7));
-    params.push_back(PG_GETARG_INT64(8));
-    params.push_back(PG_GETARG_INT64(9));
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+    std::unordered_map<std::string, size_t>::iterator itor = memo->index.find(key);
+    if (itor == memo->index.end()) {
+        return false;
+    }
+    WasmMemoEntry &entry = memo->entries[itor->second];
+    entry.referenced = true;
+    if (!wasm_is_varlena_type(rettype)) {
+        *result = entry.value;
+        return true;
+    }
+    struct varlena *value = (struct varlena*)palloc(entry.data.size() + VARHDRSZ);
+    SET_VARSIZE(value, entry.data.size() + VARHDRSZ);
+    if (entry.data.size() > 0) {
+        errno_t rc = memcpy_s(VARDATA(value), entry.data.size(), entry.data.data(), entry.data.size());
+        securec_check_c(rc, "\0", "\0");
+    }
+    *result = PointerGetDatum(value);
+    return true;
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_9);
-Datum wasm_invoke_function_9(PG_FUNCTION_ARGS)
+/*
+ * Remember the result of a call, evicting with CLOCK once the cache is full:
+ * the hand clears the referenced bit of the entries it passes and replaces
+ * the first one not hit since its last round.
+ */
+static void wasm_memo_insert(WasmMemoCache *memo, std::string &key, Oid rettype, Datum result)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
-    
-    params.push_back(PG_GETARG_INT64(2));
-    params.push_back(PG_GETARG_INT64(3));
-    params.push_back(PG_GETARG_INT64(4));
-    params.push_back(PG_GETARG_INT64(5));
-    params.push_back(PG_GETARG_INT64(6));
-    params.push_back(PG_GETARG_INT64(7));
-    params.push_back(PG_GETARG_INT64(8));
-    params.push_back(PG_GETARG_INT64(9));
-    params.push_back(PG_GETARG_INT64(10));
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+    struct varlena *data = NULL;
+    if (wasm_is_varlena_type(rettype)) {
+        data = (struct varlena*)DatumGetPointer(result);
+        if (VARSIZE_ANY_EXHDR(data) > WASM_MEMO_MAX_BYTES) {
+            return;
+        }
+    }
+
+    size_t slot;
+    if (memo->entries.size() < memo->capacity) {
+        slot = memo->entries.size();
+        memo->entries.emplace_back();
+    } else {
+        while (memo->entries[memo->hand].referenced) {
+            memo->entries[memo->hand].referenced = false;
+            memo->hand = (memo->hand + 1) % memo->entries.size();
+        }
+        slot = memo->hand;
+        memo->hand = (memo->hand + 1) % memo->entries.size();
+        memo->index.erase(memo->entries[slot].key);
+    }
+
+    WasmMemoEntry &entry = memo->entries[slot];
+    entry.key.swap(key);
+    entry.value = (data == NULL) ? result : (Datum)0;
+    entry.data.assign((data == NULL) ? "" : VARDATA_ANY(data), (data == NULL) ? 0 : VARSIZE_ANY_EXHDR(data));
+    entry.referenced = false;
+    memo->index[entry.key] = slot;
 }
 
-PG_FUNCTION_INFO_V1(wasm_invoke_function_10);
-Datum wasm_invoke_function_10(PG_FUNCTION_ARGS)
+/*
+ * Copy the elements of an array with nulls into a column of width bytes per
+ * row, zero in place of nulls, and flag the rows holding a null.
+ */
+static const char* wasm_batch_dense_column(ArrayType *array, int width, uint8 *nulls)
 {
-    char* instanceid = TextDatumGetCString(PG_GETARG_DATUM(0));
-    char* funcname = TextDatumGetCString(PG_GETARG_DATUM(1));
-    std::vector<int64> params;
-
-    params.push_back(PG_GETARG_INT64(2));
-    params.push_back(PG_GETARG_INT64(3));
-    params.push_back(PG_GETARG_INT64(4));
-    params.push_back(PG_GETARG_INT64(5));
-    params.push_back(PG_GETARG_INT64(6));
-    params.push_back(PG_GETARG_INT64(7));
-    params.push_back(PG_GETARG_INT64(8));
-    params.push_back(PG_GETARG_INT64(9));
-    params.push_back(PG_GETARG_INT64(10));
-    params.push_back(PG_GETARG_INT64(11));
-    int64 result = wasm_invoke_function(instanceid, funcname, params);
-    return Int64GetDatum(result);
+    Oid elemtype = ARR_ELEMTYPE(array);
+    int16 typlen;
+    bool typbyval = false;
+    char typalign;
+    Datum *elems = NULL;
+    bool *isnull = NULL;
+    int nelems = 0;
+    get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+    deconstruct_array(array, elemtype, typlen, typbyval, typalign, &elems, &isnull, &nelems);
+
+    wasm_valkind_t kind;
+    (void)wasm_type_valkind(elemtype, &kind);
+    char *data = (char*)palloc0((size_t)width * nelems);
+    for (int i = 0; i < nelems; i++) {
+        if (isnull[i]) {
+            nulls[i] = 1;
+            continue;
+        }
+        wasmtime_val_raw_t raw;
+        wasm_datum_to_raw(elems[i], elemtype, kind, &raw);
+        errno_t rc = memcpy_s(data + (size_t)i * width, width, &raw, width);
+        securec_check_c(rc, "\0", "\0");
+    }
+    pfree(elems);
+    pfree(isnull);
+    return data;
+}
+
+/*
+ * Rebuild the result of a batch call with the rows flagged in nulls as null
+ * elements. Results without nulls are returned as is.
+ */
+static ArrayType* wasm_batch_set_nulls(ArrayType *result, const uint8 *nulls, int nrows)
+{
+    if (std::find_if(nulls, nulls + nrows, [](uint8 flag) { return flag != 0; }) == nulls + nrows) {
+        return result;
+    }
+    Oid elemtype = ARR_ELEMTYPE(result);
+    int16 typlen;
+    bool typbyval = false;
+    char typalign;
+    Datum *elems = NULL;
+    int nelems = 0;
+    get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+    deconstruct_array(result, elemtype, typlen, typbyval, typalign, &elems, NULL, &nelems);
+
+    bool *isnull = (bool*)palloc(sizeof(bool) * nrows);
+    for (int i = 0; i < nrows; i++) {
+        isnull[i] = (nulls[i] != 0);
+    }
+    int lbound = 1;
+    return construct_md_array(elems, isnull, 1, &nrows, &lbound, elemtype, typlen, typbyval, typalign);
+}
+
+/*
+ * Batch mode of the call handler, used when the whole column is passed as
+ * arrays. Elements keep their SQL width in guest memory, i.e. 4 bytes for
+ * integer and 8 bytes for bigint, and so do the results. An export that takes
+ * null flags accepts null elements, see wasm_call_batch.
+ */
+static Datum wasm_call_handler_batch(FunctionCallInfo fcinfo, WasmCallCache *cache)
+{
+    WasmBatchColumn columns[FUNC_MAX_ARGS];
+    ArrayType *arrays[FUNC_MAX_ARGS];
+    bool with_nulls = cache->batch_nulls;
+    int nrows = -1;
+    for (int i = 0; i < cache->nargs; i++) {
+        if (PG_ARGISNULL(i)) {
+            PG_RETURN_NULL();
+        }
+        arrays[i] = PG_GETARG_ARRAYTYPE_P(i);
+        if (ARR_ELEMTYPE(arrays[i]) != cache->elemtypes[i]) {
+            ereport(ERROR, (errcode(ERRCODE_DATATYPE_MISMATCH),
+                errmsg("wasm_executor: unexpected element type of argument %d", i + 1)));
+        }
+        nrows = wasm_batch_array_items(arrays[i], nrows, with_nulls);
+    }
+    nrows = Max(nrows, 0);
+
+    uint8 *nulls = with_nulls ? (uint8*)palloc0(Max(nrows, 1)) : NULL;
+    for (int i = 0; i < cache->nargs; i++) {
+        columns[i].width = wasm_column_width(cache->elemtypes[i]);
+        columns[i].data = ARR_HASNULL(arrays[i]) ? wasm_batch_dense_column(arrays[i], columns[i].width, nulls) :
+            ARR_DATA_PTR(arrays[i]);
+    }
+
+    int outwidth = wasm_batch_result_width(cache->retelemtype);
+    ArrayType *result = wasm_alloc_array(cache->retelemtype, outwidth, nrows);
+    wasm_call_batch(cache->instinfo, cache->funcinfo, columns, cache->nargs, nrows, ARR_DATA_PTR(result), outwidth,
+        nulls);
+    if (cache->retelemtype == BOOLOID) {
+        // Any non-zero byte is true
+        char *flags = ARR_DATA_PTR(result);
+        for (int i = 0; i < nrows; i++) {
+            flags[i] = (flags[i] != 0);
+        }
+    }
+    if (nulls != NULL && nrows > 0) {
+        result = wasm_batch_set_nulls(result, nulls, nrows);
+    }
+    PG_RETURN_ARRAYTYPE_P(result);
+}
+
+/*
+ * Call handler of LANGUAGE wasm. A function is declared as
+ *   CREATE FUNCTION f(integer, integer) RETURNS integer LANGUAGE wasm AS 'module:export';
+ * and is called directly through fmgr, without any PL/pgSQL or SPI in between.
+ */
+PG_FUNCTION_INFO_V1(wasm_call_handler);
+Datum wasm_call_handler(PG_FUNCTION_ARGS)
+{
+    WasmCallCache *cache = (WasmCallCache*)fcinfo->flinfo->fn_extra;
+    if (cache == NULL || !wasm_cache_valid(cache->session, cache->generation, cache->registry_generation)) {
+        cache = wasm_call_cache_init(fcinfo);
+    } else {
+        wasm_instance_checkout(cache->instinfo);
+    }
+
+    WasmFuncInfo *funcinfo = cache->funcinfo;
+    switch (cache->mode) {
+        case WASM_CALL_SRF:
+            return wasm_call_handler_srf(fcinfo, cache);
+        case WASM_CALL_BATCH:
+            return wasm_call_handler_batch(fcinfo, cache);
+        case WASM_CALL_AGG_TRANS:
+            return wasm_agg_transfn(fcinfo, cache);
+        case WASM_CALL_AGG_FINAL:
+            return wasm_agg_finalfn(fcinfo, cache);
+        default:
+            break;
+    }
+
+    // Repeated arguments of an IMMUTABLE function skip the guest call
+    WasmMemoCache *memo = cache->memoizable ? wasm_memo_get(fcinfo, cache) : NULL;
+    std::string memokey;
+    if (memo != NULL && wasm_memo_key(fcinfo, cache, memokey)) {
+        Datum result;
+        bool hit = wasm_memo_lookup(memo, memokey, cache->rettype, &result);
+        if (wasm_get_session_context()->track_functions) {
+            WasmFuncStats *stats = &cache->instinfo->stats[funcinfo->index];
+            wasm_stat_add(hit ? stats->memo_hits : stats->memo_misses, 1);
+        }
+        if (hit) {
+            return result;
+        }
+    } else {
+        memo = NULL;
+    }
+
+    // Sampled calls are timed from here, to tell marshalling from guest time
+    uint64 sample_start = wasm_profile_begin(cache->session);
+    wasmtime_val_raw_t args_and_results[funcinfo->nraw];
+    if (!wasm_call_set_args(fcinfo, cache, args_and_results)) {
+        cache->session->profile_call = false;
+        PG_RETURN_NULL();
+    }
+
+    wasm_call_raw(cache->instinfo, funcinfo, args_and_results);
+    Datum result;
+    if (cache->mode == WASM_CALL_COMPOSITE) {
+        result = wasm_composite_datum(cache, funcinfo, args_and_results);
+    } else {
+        result = wasm_result_datum(cache, funcinfo, args_and_results);
+        if (memo != NULL) {
+            wasm_memo_insert(memo, memokey, cache->rettype, result);
+        }
+    }
+    if (sample_start != 0) {
+        wasm_profile_end(cache->session, cache->instinfo, funcinfo, sample_start);
+    }
+    return result;
 }